@@ -4,6 +4,7 @@
 #define USBAPI_DESCRIPTOR_HPP
 
 #include <sdk/types.h>
+#include <memory>
 #include <type_traits>
 
 #include <json/Json.hpp>
@@ -14,7 +15,55 @@
 
 namespace usb {
 
-using DescriptorStringList = var::Vector<var::String>;
+// String descriptors indexed by descriptor index. Nothing is fetched until a
+// string is asked for, and then only the indices the device and
+// configuration descriptors actually reference.
+class DescriptorStringList {
+public:
+  DescriptorStringList() {}
+  explicit DescriptorStringList(libusb_device *device) : m_device(device) {}
+
+  // strings read earlier, see EnumerationCache; nothing else is fetched
+  DescriptorStringList(libusb_device *device, const var::StringList &list)
+    : m_device(device), m_list(list) {
+    m_is_loaded = true;
+    for (u32 &value : m_is_fetched) {
+      value = 0xffffffff;
+    }
+  }
+
+  // fetches `index` on first use
+  const var::String &at(u8 index) const;
+
+  // a string known from somewhere else, `index` won't be fetched
+  DescriptorStringList &set(u8 index, const var::StringView value);
+
+  // fetches every referenced string that isn't loaded yet with one open
+  const DescriptorStringList &load() const;
+
+  const var::StringList &list() const { return m_list; }
+
+  // true once every referenced string has been read
+  bool is_loaded() const { return m_is_loaded; }
+
+  // marks the list loaded if every referenced string is already known,
+  // nothing is fetched
+  bool check_loaded() const;
+
+  bool is_fetched(u8 index) const {
+    return m_is_fetched[index / 32] & (1u << (index % 32));
+  }
+
+private:
+  libusb_device *m_device = nullptr;
+  mutable bool m_is_loaded = false;
+  mutable var::StringList m_list;
+  mutable u32 m_is_fetched[8] = {0};
+
+  // false if the device couldn't be opened or a string couldn't be read
+  bool fetch(const var::Vector<u8> &index_list) const;
+  var::Vector<u8> get_referenced_index_list() const;
+};
 
 class UsbFlags {
 public:
@@ -37,10 +86,7 @@ public:
   }
 
   const var::String &string(u8 index) const {
-    if (index < string_list().count()) {
-      return string_list().at(index);
-    }
-    return var::String::empty_string();
+    return string_list().at(index);
   }
 
 protected:
@@ -48,6 +94,54 @@ protected:
   const DescriptorStringList &m_string_list_reference;
 };
 
+// Iterates a libusb descriptor array in place, wrapping each element on
+// dereference. Nothing is allocated so it is cheap to use in nested loops.
+template <typename Wrapper, typename T> class DescriptorRange {
+public:
+  class Iterator {
+  public:
+    Iterator(const T *value, const DescriptorStringList &string_list)
+      : m_value(value), m_string_list(&string_list) {}
+
+    Wrapper operator*() const { return Wrapper(m_value, *m_string_list); }
+
+    Iterator &operator++() {
+      ++m_value;
+      return *this;
+    }
+
+    bool operator==(const Iterator &a) const { return m_value == a.m_value; }
+    bool operator!=(const Iterator &a) const { return m_value != a.m_value; }
+
+  private:
+    const T *m_value;
+    const DescriptorStringList *m_string_list;
+  };
+
+  DescriptorRange(
+    const T *value,
+    size_t count,
+    const DescriptorStringList &string_list)
+    : m_value(value), m_count(value != nullptr ? count : 0),
+      m_string_list(string_list) {}
+
+  Iterator begin() const { return Iterator(m_value, m_string_list); }
+  Iterator end() const { return Iterator(m_value + m_count, m_string_list); }
+
+  size_t count() const { return m_count; }
+  bool is_empty() const { return m_count == 0; }
+
+  Wrapper at(size_t offset) const {
+    API_ASSERT(offset < m_count);
+    return Wrapper(m_value + offset, m_string_list);
+  }
+
+private:
+  const T *m_value;
+  size_t m_count;
+  const DescriptorStringList &m_string_list;
+};
+
 class EndpointDescriptor
   : public Descriptor<struct libusb_endpoint_descriptor> {
 public:
@@ -97,6 +191,8 @@ public:
 };
 
 using EndpointDescriptorList = var::Vector<EndpointDescriptor>;
+using EndpointDescriptorRange
+  = DescriptorRange<EndpointDescriptor, struct libusb_endpoint_descriptor>;
 
 class InterfaceDescriptor
   : public Descriptor<struct libusb_interface_descriptor> {
@@ -122,6 +218,13 @@ public:
 
   const var::String &interface_string() const { return string(i_interface()); }
 
+  EndpointDescriptorRange endpoints() const {
+    return EndpointDescriptorRange(
+      m_value->endpoint,
+      endpoint_count(),
+      string_list());
+  }
+
   EndpointDescriptorList endpoint_list() const {
     EndpointDescriptorList result;
     for (size_t i = 0; i < endpoint_count(); i++) {
@@ -137,6 +240,8 @@ public:
 };
 
 using InterfaceDescriptorList = var::Vector<InterfaceDescriptor>;
+using InterfaceDescriptorRange
+  = DescriptorRange<InterfaceDescriptor, struct libusb_interface_descriptor>;
 
 class Interface {
 public:
@@ -149,6 +254,13 @@ public:
 
   u8 alternate_settings_count() const { return m_value->num_altsetting; }
 
+  InterfaceDescriptorRange alternate_settings() const {
+    return InterfaceDescriptorRange(
+      m_value->altsetting,
+      alternate_settings_count(),
+      m_string_list);
+  }
+
   InterfaceDescriptorList alternate_settings_list() const {
     InterfaceDescriptorList result;
     for (size_t i = 0; i < alternate_settings_count(); i++) {
@@ -166,6 +278,7 @@ private:
 };
 
 using InterfaceList = var::Vector<Interface>;
+using InterfaceRange = DescriptorRange<Interface, struct libusb_interface>;
 
 class ConfigurationDescriptor
   : public Descriptor<struct libusb_config_descriptor> {
@@ -193,8 +306,17 @@ public:
     load_descriptors();
   }
 
+  // wraps a descriptor that has already been fetched, see Device
+  ConfigurationDescriptor(
+    std::shared_ptr<const libusb_config_descriptor> configuration,
+    const DescriptorStringList &string_list)
+    : Descriptor(configuration.get(), string_list) {
+    m_configuration = std::move(configuration);
+  }
+
+  // copies share the parsed descriptor, libusb is only called once
   ConfigurationDescriptor(const ConfigurationDescriptor &a)
-    : Descriptor(nullptr, a.string_list()) {
+    : Descriptor(a.m_value, a.string_list()) {
     copy_configuration(a);
   }
 
@@ -204,22 +326,22 @@ public:
   }
 
   ConfigurationDescriptor(ConfigurationDescriptor &&a)
-    : Descriptor(nullptr, a.string_list()) {
-    std::swap(*this, a);
+    : Descriptor(a.m_value, a.string_list()) {
+    copy_configuration(a);
+    a.m_configuration.reset();
+    a.m_value = nullptr;
   }
 
   ConfigurationDescriptor &operator=(ConfigurationDescriptor &&a) {
-    std::swap(*this, a);
+    if (this != &a) {
+      copy_configuration(a);
+      a.m_configuration.reset();
+      a.m_value = nullptr;
+    }
     return *this;
   }
 
-  ~ConfigurationDescriptor() {
-    if (m_value != nullptr) {
-      libusb_free_config_descriptor(
-        (struct libusb_config_descriptor *)(m_value));
-      m_value = nullptr;
-    }
-  }
+  bool is_valid() const { return m_value != nullptr; }
 
   u16 total_length() const {
     API_ASSERT(m_value != nullptr);
@@ -255,6 +377,11 @@ public:
     return m_value->MaxPower;
   }
 
+  InterfaceRange interfaces() const {
+    API_ASSERT(m_value != nullptr);
+    return InterfaceRange(m_value->interface, interface_count(), string_list());
+  }
+
   InterfaceList interface_list() const {
     InterfaceList result;
     API_ASSERT(m_value != nullptr);
@@ -275,6 +402,7 @@ private:
   struct libusb_device *m_device = nullptr;
   u8 m_configuration_index = 0;
   bool m_is_active_configuration = false;
+  std::shared_ptr<const libusb_config_descriptor> m_configuration;
 
   void load_descriptors() {
     API_RETURN_IF_ERROR();
@@ -291,6 +419,10 @@ private:
           m_configuration_index,
           &descriptor));
     }
+
+    if (descriptor != nullptr) {
+      m_configuration.reset(descriptor, libusb_free_config_descriptor);
+    }
     m_value = descriptor;
   }
 
@@ -298,7 +430,8 @@ private:
     m_device = a.m_device;
     m_is_active_configuration = a.m_is_active_configuration;
     m_configuration_index = a.m_configuration_index;
-    load_descriptors();
+    m_configuration = a.m_configuration;
+    m_value = a.m_value;
   }
 };
 
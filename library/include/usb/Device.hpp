@@ -3,11 +3,16 @@
 #ifndef USBAPI_DEVICE_HPP
 #define USBAPI_DEVICE_HPP
 
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
 #include <fs/File.hpp>
 #include <var/Data.hpp>
 #include <var/Vector.hpp>
 
 #include "Descriptor.hpp"
+#include "Transfer.hpp"
 
 namespace usb {
 
@@ -22,7 +27,7 @@ public:
 
   Endpoint(const EndpointDescriptor &endpoint_descriptor) {
     m_transfer_type = endpoint_descriptor.transfer_type();
-    m_address = endpoint_descriptor.endpoint_address() & 0x7f;
+    m_address = endpoint_descriptor.endpoint_address();
     m_max_packet_size = endpoint_descriptor.max_packet_size();
     m_interface = 0;
   }
@@ -34,8 +39,14 @@ public:
     return *this;
   }
 
+  // keeps the direction bit, address() still reports the number only
   Endpoint &set_address(u8 value) {
-    m_address = value & 0x7f;
+    m_address = value;
+    return *this;
+  }
+
+  Endpoint &set_max_packet_size(u16 value) {
+    m_max_packet_size = value;
     return *this;
   }
 
@@ -46,7 +57,15 @@ public:
 
   TransferType transfer_type() const { return m_transfer_type; }
 
-  u8 address() const { return m_address; }
+  u8 address() const { return m_address & 0x7f; }
+
+  u8 endpoint_address() const { return m_address; }
+
+  u8 number() const { return m_address & 0x0f; }
+
+  bool is_direction_in() const { return m_address & 0x80; }
+
+  bool is_direction_out() const { return (m_address & 0x80) == 0; }
 
   u8 read_address() const { return m_address | 0x80; }
 
@@ -72,25 +91,23 @@ class Device;
 
 class DeviceHandle : public fs::FileAccess<DeviceHandle>, public UsbFlags {
 public:
+  // configuration values besides those of the device, unconfigure is
+  // libusb's -1 and keep_configuration opens without changing anything
+  enum { unconfigure = -1, keep_configuration = -2 };
+
   DeviceHandle() {}
 
+  // only calls libusb_set_configuration() if `configuration` isn't active
   DeviceHandle(
     libusb_device_handle *handle,
-    Device *device,
+    const Device *device,
     int configuration,
-    const var::StringView name) {
-    m_device = device;
-    m_handle = handle;
-    set_configuration(configuration);
-    open(name, fs::OpenMode::read_write());
-  }
+    const var::StringView name);
 
   DeviceHandle &&move() { return std::move(*this); }
 
-  DeviceHandle &set_device(Device *device) {
-    m_device = device;
-    return *this;
-  }
+  // keeps a copy of `device`, copies share the descriptors read from it
+  DeviceHandle &set_device(const Device *device);
 
   DeviceHandle(DeviceHandle &&a) { swap(a); }
   DeviceHandle &operator=(DeviceHandle &&a) {
@@ -102,6 +119,12 @@ public:
 
   bool is_valid() const { return m_handle != nullptr; }
 
+  // set once a transfer reports LIBUSB_ERROR_NO_DEVICE, checking it costs
+  // no USB traffic
+  bool is_disconnected() const { return m_is_disconnected; }
+
+  const Device *device() const { return m_device.get(); }
+
   u32 size() const { return 0; }
 
   int get_configuration() {
@@ -113,13 +136,9 @@ public:
     return configuration_number;
   }
 
-  DeviceHandle &set_configuration(int configuration_number) {
-    API_RETURN_VALUE_IF_ERROR(*this);
-    API_SYSTEM_CALL(
-      "DeviceHandle::libusb_set_configuration",
-      libusb_set_configuration(m_handle, configuration_number));
-    return *this;
-  }
+  DeviceHandle &set_configuration(int configuration_number);
+
+  bool is_configuration_active(int configuration_number);
 
   DeviceHandle &claim_interface() {
     API_RETURN_VALUE_IF_ERROR(*this);
@@ -152,11 +171,7 @@ public:
     return *this;
   }
 
-  DeviceHandle &reset() {
-    API_RETURN_VALUE_IF_ERROR(*this);
-    API_SYSTEM_CALL("DeviceHandle::libusb_reset_device", libusb_reset_device(m_handle));
-    return *this;
-  }
+  DeviceHandle &reset();
 
   bool is_kernel_driver_active(int interface_number) {
     API_RETURN_VALUE_IF_ERROR(false);
@@ -182,6 +197,20 @@ public:
     return *this;
   }
 
+  // seek() binds reads and writes to the same endpoint number, this binds
+  // them to separate IN and OUT endpoints so they can run concurrently
+  DeviceHandle &set_pipe(u8 in_address, u8 out_address) {
+    m_location = in_address & 0x0f;
+    m_write_location = out_address & 0x0f;
+    return *this;
+  }
+
+  const Endpoint &find_endpoint(u8 endpoint_address) const {
+    const Endpoint &result = m_endpoint_table[endpoint_address & 0x0f]
+                                             [(endpoint_address & 0x80) != 0];
+    return result.is_valid() ? result : Endpoint::empty();
+  }
+
   DeviceHandle &set_auto_detach_kernel_driver(bool value = true) {
     API_RETURN_VALUE_IF_ERROR(*this);
     API_SYSTEM_CALL("DeviceHandle::libusb_set_auto_detach_kernel_driver", libusb_set_auto_detach_kernel_driver(m_handle, value));
@@ -189,37 +218,108 @@ public:
   }
 
 private:
+  // ring buffer: m_head and m_tail run freely and are masked on access
   class DeviceReadBuffer {
   public:
+    DeviceReadBuffer &set_capacity(u32 value) {
+      u32 capacity = value ? 1 : 0;
+      while (capacity < value) {
+        capacity <<= 1;
+      }
+      m_buffer.resize(capacity);
+      m_head = 0;
+      m_tail = 0;
+      return *this;
+    }
+
+    u32 capacity() const { return m_buffer.size(); }
+    u32 size() const { return m_tail - m_head; }
+
     int copy_and_erase_bytes(void *dest, int nbyte) {
-      int byte_count = nbyte < buffer().size() ? nbyte : buffer().size();
-      if (byte_count) {
-        memcpy(dest, buffer().data(), byte_count);
-        m_buffer(var::Data::Erase().set_size(byte_count));
+      const u32 byte_count = static_cast<u32>(nbyte) < size() ? nbyte : size();
+      u8 *destination = static_cast<u8 *>(dest);
+      u32 bytes_copied = 0;
+      while (bytes_copied < byte_count) {
+        const u32 offset = (m_head + bytes_copied) & (capacity() - 1);
+        const u32 page_size = capacity() - offset < byte_count - bytes_copied
+                                ? capacity() - offset
+                                : byte_count - bytes_copied;
+        memcpy(destination + bytes_copied, m_buffer.data() + offset, page_size);
+        bytes_copied += page_size;
+      }
+      m_head += byte_count;
+      if (m_head == m_tail) {
+        // start over so the next transfer gets all the contiguous space
+        m_head = 0;
+        m_tail = 0;
       }
       return byte_count;
     }
 
+    // contiguous free space that a transfer can fill in place
+    u8 *tail_data() { return m_buffer.data() + (m_tail & (capacity() - 1)); }
+
+    u32 tail_size() const {
+      const u32 offset = m_tail & (capacity() - 1);
+      const u32 free_size = capacity() - size();
+      return free_size < capacity() - offset ? free_size : capacity() - offset;
+    }
+
+    DeviceReadBuffer &push(u32 size) {
+      m_tail += size;
+      return *this;
+    }
+
   private:
-    API_ACCESS_COMPOUND(DeviceReadBuffer, var::Data, buffer);
-    API_ACCESS_FUNDAMENTAL(DeviceReadBuffer, u8, address, 0xff);
+    var::Data m_buffer;
+    u32 m_head = 0;
+    u32 m_tail = 0;
   };
 
+  enum { endpoint_count = 16 };
+
   mutable u8 m_location;
+  mutable u8 m_write_location;
   int m_interface_number;
   API_READ_ACCESS_COMPOUND(DeviceHandle, EndpointList, endpoint_list);
   API_ACCESS_COMPOUND(DeviceHandle, chrono::MicroTime, timeout);
-  mutable var::Vector<DeviceReadBuffer> m_read_buffer_list;
+  // 0 uses synchronous libusb transfers, otherwise the number of bulk
+  // transfers kept in flight per endpoint and direction
+  API_ACCESS_FUNDAMENTAL(DeviceHandle, u8, queue_depth, 0);
+  // 0 moves one max_packet_size packet per libusb call, otherwise the size
+  // of the slice handed to libusb in a single transfer (rounded down to
+  // whole packets)
+  API_ACCESS_FUNDAMENTAL(DeviceHandle, u32, transfer_size, 0);
+  // indexed by endpoint number then direction (0 is OUT, 1 is IN)
+  Endpoint m_endpoint_table[endpoint_count][2];
+  mutable DeviceReadBuffer m_read_buffer_table[endpoint_count];
+  mutable std::unique_ptr<TransferQueue>
+    m_transfer_queue_table[endpoint_count][2];
 
   libusb_device_handle *m_handle = nullptr;
-  Device *m_device = nullptr;
+  // a copy rather than a pointer into a DeviceList that may be refreshed
+  std::shared_ptr<Device> m_device;
+  // set when the handle wraps a file descriptor, see Device::wrap_handle()
+  int m_wrapped_fd = -1;
+  mutable bool m_is_disconnected = false;
+
+  friend class Device;
 
   void swap(DeviceHandle &a) {
     std::swap(m_handle, a.m_handle);
     std::swap(m_device, a.m_device);
     std::swap(m_endpoint_list, a.m_endpoint_list);
     std::swap(m_timeout, a.m_timeout);
+    std::swap(m_queue_depth, a.m_queue_depth);
+    std::swap(m_transfer_size, a.m_transfer_size);
     std::swap(m_interface_number, a.m_interface_number);
+    std::swap(m_location, a.m_location);
+    std::swap(m_write_location, a.m_write_location);
+    std::swap(m_endpoint_table, a.m_endpoint_table);
+    std::swap(m_read_buffer_table, a.m_read_buffer_table);
+    std::swap(m_transfer_queue_table, a.m_transfer_queue_table);
+    std::swap(m_wrapped_fd, a.m_wrapped_fd);
+    std::swap(m_is_disconnected, a.m_is_disconnected);
   }
 
   int interface_lseek(int offset, int whence) const override final {
@@ -233,6 +333,7 @@ private:
     case Whence::end:
       return -1;
     }
+    m_write_location = m_location;
     return m_location;
   }
 
@@ -257,17 +358,19 @@ private:
     m_interface_number = -1;
   }
 
-  void close() {
-    if (m_handle) {
-      libusb_device_handle *handle = m_handle;
-      release_interface();
-      m_handle = nullptr;
-      libusb_close(handle);
-    }
+  void close();
+
+  const Endpoint &get_endpoint(u8 address, bool is_read) const {
+    const Endpoint *entry = m_endpoint_table[address & 0x0f];
+    // a number without a pipe in this direction uses the other one
+    return entry[is_read].is_valid() ? entry[is_read] : entry[!is_read];
   }
 
-  const Endpoint &find_endpoint(u8 address) const;
   void load_endpoint_list();
+  TransferQueue *get_transfer_queue(const Endpoint &endpoint, bool is_read)
+    const;
+  void finalize_transfer_queues();
+  int get_page_size(const Endpoint &endpoint) const;
   int transfer(const Endpoint &endpoint, void *buf, int nbyte, bool is_read)
     const;
   int transfer_packet(
@@ -279,10 +382,23 @@ private:
 
 class Device : public api::ExecutionContext, public UsbFlags {
 public:
-  Device(libusb_device *device);
+  Device(libusb_device *device, libusb_context *context = nullptr);
 
   bool is_valid() const { return m_device != nullptr; }
 
+  // true if `a` is a copy of this Device and shares what was read from it
+  bool is_same(const Device &a) const { return m_cache == a.m_cache; }
+
+  // Opens the device behind a usbfs file descriptor without enumerating the
+  // bus, see libusb_wrap_sys_device(). The handle keeps its own Device and
+  // closes `fd` when it is closed if `is_fd_owned` is set.
+  static DeviceHandle wrap_handle(
+    libusb_context *context,
+    int fd,
+    int configuration,
+    const var::StringView path,
+    bool is_fd_owned = false);
+
   DeviceHandle get_handle(int configuration, const var::StringView path) {
     if (is_error()) {
       return DeviceHandle();
@@ -293,7 +409,7 @@ public:
     if (is_error()) {
 			return DeviceHandle();
     }
-		return DeviceHandle(handle, this, configuration, path);
+    return DeviceHandle(handle, this, configuration, path);
   }
 
   u8 get_bus_number() const {
@@ -316,7 +432,7 @@ public:
 
   Device get_parent() const {
     API_RETURN_VALUE_IF_ERROR(0);
-    return Device(libusb_get_parent(m_device));
+    return Device(libusb_get_parent(m_device), m_context);
   }
 
   u8 get_device_address() const {
@@ -342,11 +458,91 @@ public:
     return result;
   }
 
+  libusb_context *context() const { return m_context; }
+
+  libusb_device *native_device() const { return m_device; }
+
+  // loads every referenced string on first use
+  const var::StringList &string_list() const {
+    return m_cache->string_list.load().list();
+  }
+
+  // true once every referenced string has been read or restored
+  bool is_string_list_loaded() const {
+    return m_cache->string_list.is_loaded();
+  }
+
+  // see DescriptorStringList::check_loaded()
+  bool check_string_list_loaded() const {
+    return m_cache->string_list.check_loaded();
+  }
+
+  // restores strings read earlier, the device isn't opened to read them
+  Device &set_string_list(const var::StringList &value) {
+    m_cache->string_list = DescriptorStringList(m_device, value);
+    return *this;
+  }
+
+  // true if string `index` can be read without opening the device
+  bool is_string_loaded(u8 index) const {
+    return index == 0 || m_cache->string_list.is_fetched(index);
+  }
+
+  // one string known without opening the device, see Sysfs
+  Device &set_string(u8 index, const var::StringView value) {
+    m_cache->string_list.set(index, value);
+    return *this;
+  }
+
+  // Descriptors and strings are fetched once and kept for the life of the
+  // Device. DeviceHandle::reset() and set_configuration() call these, call
+  // them directly if the device is changed some other way.
+  Device &invalidate_descriptors();
+  Device &invalidate_active_configuration() {
+    m_cache->active_configuration.reset();
+    return *this;
+  }
+
+  // value of the cached active configuration, -1 if it isn't cached
+  int active_configuration_value() const {
+    return m_cache->active_configuration
+             ? m_cache->active_configuration->bConfigurationValue
+             : -1;
+  }
+
+  // Any of the strings or an interface of the first configuration names
+  // StratifyOS. Worked out once and kept with the cached descriptors.
+  bool is_stratify_os() const;
+  static bool is_stratify_os(const InterfaceDescriptor &interface_descriptor);
+
+  // case insensitive and without allocating, `value` must be lower case
+  static bool contains_ignore_case(
+    const var::StringView string,
+    const var::StringView value);
+
 private:
+  using ConfigurationPointer = std::shared_ptr<const libusb_config_descriptor>;
+
+  enum class StratifyOsState : u8 { unknown, no, yes };
+
+  // Shared by copies of the Device, a refreshed DeviceList or a DeviceHandle
+  // reuses what was already read from the device.
+  class Cache {
+  public:
+    explicit Cache(libusb_device *device) : string_list(device) {}
+    DescriptorStringList string_list;
+    bool is_device_descriptor_loaded = false;
+    libusb_device_descriptor device_descriptor = {0};
+    ConfigurationPointer active_configuration;
+    var::Vector<ConfigurationPointer> configuration_list;
+    StratifyOsState stratify_os_state = StratifyOsState::unknown;
+  };
+
   libusb_device *m_device = nullptr;
-  API_READ_ACCESS_COMPOUND(Device, var::StringList, string_list);
+  libusb_context *m_context = nullptr;
+  std::shared_ptr<Cache> m_cache;
 
-  void load_strings();
+  void load_strings() { m_cache->string_list.load(); }
 };
 
 class DeviceList : public UsbFlags, public var::Vector<Device> {
@@ -357,10 +553,48 @@ public:
     API_AC(Find, var::StringView, serial_number);
   };
 
+  // O(1) through an index on (vid, pid) and serial number. Serial numbers
+  // are only read for devices that match the vid and pid.
   Device *find(const Find &options);
   inline Device *operator()(const Find &options) { return find(options); }
 
+  // call after changing the devices in place, find() then rebuilds the
+  // index. Resizing the list is noticed without it.
+  DeviceList &mark_changed() {
+    m_generation++;
+    return *this;
+  }
+  // changes each time the devices change, Session bumps it only when a
+  // refresh found a different list
+  u32 generation() const { return m_generation; }
+
+  // rebuilds the index now instead of on the next find()
+  DeviceList &update_index();
+
+  static u32 get_serial_hash(const var::StringView serial_number);
+
 private:
+  // (vid << 16) | pid to positions in list order
+  std::unordered_map<u32, var::Vector<u32>> m_product_index;
+  // (vid << 16 | pid) << 32 | serial hash to the first position
+  std::unordered_map<u64, u32> m_serial_index;
+  // products whose serial numbers are in m_serial_index
+  std::unordered_set<u32> m_serial_indexed_product_set;
+  const Device *m_indexed_data = nullptr;
+  size_t m_indexed_count = 0;
+  u32 m_generation = 0;
+  u32 m_indexed_generation = 0;
+
+  bool is_index_current() const {
+    return m_indexed_data == data() && m_indexed_count == count()
+           && m_indexed_generation == m_generation;
+  }
+
+  static u32 get_product_key(u16 vendor_id, u16 product_id) {
+    return (u32(vendor_id) << 16) | product_id;
+  }
+
+  Device *find_serial_number(u32 product_key, const var::StringView serial);
 };
 
 } // namespace usb
@@ -0,0 +1,75 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#ifndef USBAPI_DEVICE_SUMMARY_TABLE_HPP
+#define USBAPI_DEVICE_SUMMARY_TABLE_HPP
+
+#include <var/Vector.hpp>
+
+#include "Descriptor.hpp"
+
+namespace usb {
+
+// The descriptor fields device filters look at, one contiguous array per
+// field. find() is a branch free loop over the arrays that the compiler can
+// vectorize and that stays in cache for thousands of rows. It is only a
+// pre-filter: strings and interfaces aren't in the table so rows still have
+// to pass SessionOptions::is_match() unless is_summary_match() is true.
+class DeviceSummaryTable {
+public:
+  // zero matches anything, the class fields are as wide as the ones in
+  // SessionOptions so a value above 0xff matches nothing instead of being
+  // truncated
+  class Query {
+    API_AF(Query, u16, vendor_id, 0);
+    API_AF(Query, u16, product_id, 0);
+    API_AF(Query, u16, device_class, 0);
+    API_AF(Query, u16, device_sub_class, 0);
+    API_AF(Query, u8, bus_number, 0);
+    API_AF(Query, u8, device_address, 0);
+  };
+
+  DeviceSummaryTable() = default;
+  ~DeviceSummaryTable() { clear(); }
+
+  DeviceSummaryTable(const DeviceSummaryTable &) = delete;
+  DeviceSummaryTable &operator=(const DeviceSummaryTable &) = delete;
+
+  DeviceSummaryTable &clear();
+  DeviceSummaryTable &reserve(size_t count);
+
+  // reads what libusb holds in memory, the device is not opened
+  DeviceSummaryTable &push_back(libusb_device *device);
+
+  size_t count() const { return m_vendor_id_list.count(); }
+
+  // rows that match `query` in order
+  var::Vector<u32> find(const Query &query) const;
+
+  u16 vendor_id(size_t row) const { return m_vendor_id_list.at(row); }
+  u16 product_id(size_t row) const { return m_product_id_list.at(row); }
+  u8 device_class(size_t row) const { return m_device_class_list.at(row); }
+  u8 device_sub_class(size_t row) const {
+    return m_device_sub_class_list.at(row);
+  }
+  u8 bus_number(size_t row) const { return m_bus_number_list.at(row); }
+  u8 device_address(size_t row) const {
+    return m_device_address_list.at(row);
+  }
+  libusb_device *device(size_t row) const { return m_device_list.at(row); }
+
+private:
+  var::Vector<u16> m_vendor_id_list;
+  var::Vector<u16> m_product_id_list;
+  var::Vector<u8> m_device_class_list;
+  var::Vector<u8> m_device_sub_class_list;
+  var::Vector<u8> m_bus_number_list;
+  var::Vector<u8> m_device_address_list;
+  // each holds a reference so libusb can't reuse the pointer while the row
+  // is compared to tell whether it is still current
+  var::Vector<libusb_device *> m_device_list;
+  mutable var::Vector<u8> m_match_list;
+};
+
+} // namespace usb
+
+#endif // USBAPI_DEVICE_SUMMARY_TABLE_HPP
@@ -0,0 +1,97 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#ifndef USBAPI_ENUMERATION_CACHE_HPP
+#define USBAPI_ENUMERATION_CACHE_HPP
+
+#include <var/Data.hpp>
+#include <var/String.hpp>
+#include <var/Vector.hpp>
+
+#include "Device.hpp"
+
+namespace usb {
+
+// Strings of devices that were enumerated before, kept in a file so that a
+// new process doesn't have to open the devices to read them again.
+//
+// Entries are keyed by bus, port path, VID/PID and bcdDevice. A device that
+// is moved, replaced or reflashed no longer matches its old entry. The file
+// is mapped read-only and replaced in one rename when it is saved. A missing
+// or damaged file is treated as empty, the cache never fails enumeration.
+class EnumerationCache {
+public:
+  EnumerationCache() {}
+  ~EnumerationCache() { close(); }
+
+  EnumerationCache(const EnumerationCache &) = delete;
+  EnumerationCache &operator=(const EnumerationCache &) = delete;
+
+  // maps `path` if it exists, save() creates it
+  EnumerationCache &open(const var::StringView path);
+  EnumerationCache &close();
+  bool is_open() const { return m_path.is_empty() == false; }
+
+  // copies the cached strings into `device`, false if there is no entry
+  bool restore(Device &device) const;
+
+  // adds or replaces the entry for `device`, reads its strings if needed
+  EnumerationCache &store(const Device &device);
+
+  // writes the stored entries along with the mapped ones they don't replace
+  EnumerationCache &save();
+
+private:
+  enum { magic = 0x43425355, version = 1, port_path_size = 7 };
+
+  // fixed part of an entry, followed by `string_count` strings, each one
+  // its descriptor index, its length and the characters
+  class Record {
+  public:
+    u16 size;
+    u16 vendor_id;
+    u16 product_id;
+    u16 bcd_device;
+    u8 bus_number;
+    u8 port_count;
+    u8 port_path[port_path_size];
+    u8 string_count;
+
+    // everything between `size` and `string_count`
+    bool is_key_equal(const Record &a) const {
+      const u8 *start = reinterpret_cast<const u8 *>(&vendor_id);
+      return memcmp(start, &a.vendor_id, &string_count - start) == 0;
+    }
+  };
+  static_assert(sizeof(Record) == 18, "Record must not be padded");
+
+  class Header {
+  public:
+    u32 magic;
+    u16 version;
+    u16 record_count;
+  };
+
+  var::String m_path;
+  const u8 *m_map = nullptr;
+  size_t m_map_size = 0;
+  var::Data m_map_buffer;
+  // start of each valid record in the map
+  var::Vector<const u8 *> m_record_list;
+  // entries stored since the file was mapped
+  var::Vector<var::Data> m_store_list;
+
+  void map();
+  void unmap();
+  const u8 *find(const Record &key) const;
+
+  static bool get_key(const Device &device, Record &key);
+  static Record get_record(const u8 *data) {
+    Record result;
+    memcpy(&result, data, sizeof(Record));
+    return result;
+  }
+};
+
+} // namespace usb
+
+#endif // USBAPI_ENUMERATION_CACHE_HPP
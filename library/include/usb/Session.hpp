@@ -3,7 +3,14 @@
 #ifndef USBAPI_SESSION_HPP
 #define USBAPI_SESSION_HPP
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 #include "Device.hpp"
+#include "DeviceSummaryTable.hpp"
+#include "EnumerationCache.hpp"
+#include "Sysfs.hpp"
 
 namespace usb {
 
@@ -11,7 +18,50 @@ class SessionOptions {
 public:
   bool is_all() const {
     return vendor_id() + product_id() + device_class() + device_sub_class()
-           == 0;
+               + bus_number() + interface_class() + interface_sub_class()
+               + interface_protocol()
+             == 0
+           && port_path().count() == 0;
+  }
+
+  // Only looks at the device descriptor. Zero matches anything.
+  bool is_match(const libusb_device_descriptor &descriptor) const {
+    if (vendor_id() && (descriptor.idVendor != vendor_id())) {
+      return false;
+    }
+    if (product_id() && (descriptor.idProduct != product_id())) {
+      return false;
+    }
+    if (device_class() && (descriptor.bDeviceClass != device_class())) {
+      return false;
+    }
+    if (
+      device_sub_class()
+      && (descriptor.bDeviceSubClass != device_sub_class())) {
+      return false;
+    }
+    return true;
+  }
+
+  // Applies every filter using only what libusb already holds in memory,
+  // the device is never opened.
+  bool is_match(libusb_device *device) const;
+
+  // the filters a DeviceSummaryTable can apply
+  DeviceSummaryTable::Query to_summary_query() const {
+    return DeviceSummaryTable::Query()
+      .set_vendor_id(vendor_id())
+      .set_product_id(product_id())
+      .set_device_class(device_class())
+      .set_device_sub_class(device_sub_class())
+      .set_bus_number(bus_number());
+  }
+
+  // true if to_summary_query() covers every filter
+  bool is_summary_match() const {
+    return port_path().count() == 0
+           && interface_class() + interface_sub_class() + interface_protocol()
+                == 0;
   }
 
 private:
@@ -19,71 +69,203 @@ private:
   API_ACCESS_FUNDAMENTAL(SessionOptions, u16, product_id, 0);
   API_ACCESS_FUNDAMENTAL(SessionOptions, u16, device_class, 0);
   API_ACCESS_FUNDAMENTAL(SessionOptions, u16, device_sub_class, 0);
+  API_ACCESS_FUNDAMENTAL(SessionOptions, u8, bus_number, 0);
+  // port numbers from the root hub down, see libusb_get_port_numbers()
+  API_ACCESS_COMPOUND(SessionOptions, var::Vector<u8>, port_path);
+  // any alternate setting of any configuration can match
+  API_ACCESS_FUNDAMENTAL(SessionOptions, u16, interface_class, 0);
+  API_ACCESS_FUNDAMENTAL(SessionOptions, u16, interface_sub_class, 0);
+  API_ACCESS_FUNDAMENTAL(SessionOptions, u16, interface_protocol, 0);
+  // more than one opens the listed devices and reads their strings on this
+  // many threads, otherwise strings are read when first used
+  API_ACCESS_FUNDAMENTAL(SessionOptions, u8, worker_count, 0);
+
+  bool is_interface_match(const libusb_interface_descriptor &descriptor) const;
+};
+
+// where a device is connected, see Session::rescan()
+class DeviceLocation {
+  API_AF(DeviceLocation, u8, bus_number, 0);
+  API_AC(DeviceLocation, var::Vector<u8>, port_path);
+  API_AF(DeviceLocation, u8, device_address, 0);
+  API_AF(DeviceLocation, u16, vendor_id, 0);
+  API_AF(DeviceLocation, u16, product_id, 0);
+};
+
+class Rescan {
+  API_AC(Rescan, DeviceList, added_list);
+  API_AC(Rescan, var::Vector<DeviceLocation>, removed_list);
+
+public:
+  bool is_empty() const {
+    return added_list().count() == 0 && removed_list().count() == 0;
+  }
 };
 
 class Session : public api::ExecutionContext, public UsbFlags {
 public:
-  Session();
+  enum class IsDeviceDiscovery { no, yes };
+
+  // IsDeviceDiscovery::no keeps libusb from scanning the bus, only
+  // open_device() and wrap_device() can reach devices then. Before libusb
+  // 1.0.27 this sets a process wide default that every libusb context
+  // created afterwards gets, including other Sessions, and it can't be
+  // undone.
+  explicit Session(
+    IsDeviceDiscovery is_device_discovery = IsDeviceDiscovery::yes);
   ~Session() {
+    stop_hotplug();
+    stop_event_thread();
     free_device_list();
     free_context();
   }
 
   void reinitialize() {
     API_RETURN_IF_ERROR();
+    const bool is_event_thread = is_event_thread_running();
+    stop_hotplug();
+    stop_event_thread();
     free_device_list();
     free_context();
-    API_SYSTEM_CALL("Session::libusb_init", libusb_init(&m_context));
+    API_SYSTEM_CALL("Session::libusb_init", init_context());
+    if (is_event_thread) {
+      start_event_thread();
+    }
   }
 
-  const DeviceList &get_device_list(const SessionOptions &options) {
-    m_device_list.clear();
-    API_RETURN_VALUE_IF_ERROR(device_list());
+  libusb_context *context() const { return m_context; }
 
-    free_device_list();
+  // Handles libusb events in the background so Transfer callbacks and
+  // hotplug notifications run without anyone polling. TransferQueue keeps
+  // working either way.
+  Session &start_event_thread();
+  Session &stop_event_thread();
+  bool is_event_thread_running() const { return m_event_thread.joinable(); }
 
-    if (m_libusb_device_list != nullptr) {
-      libusb_free_device_list(m_libusb_device_list, 1);
-      m_libusb_device_list = nullptr;
-    }
+  // Devices that are still connected keep their Device and what was read
+  // from them. The list and pointers into it stay the same if the same
+  // devices are listed again.
+  const DeviceList &get_device_list(const SessionOptions &options);
 
-    ssize_t count = API_SYSTEM_CALL(
-      "Session::libusb_get_device_list",
-      libusb_get_device_list(m_context, &m_libusb_device_list));
-
-    m_device_list.reserve(count);
-    for (ssize_t i = 0; i < count; i++) {
-      libusb_device_descriptor desc;
-      bool is_match = true;
-      if (options.is_all() == false) {
-        libusb_get_device_descriptor(m_libusb_device_list[i], &desc);
-        if (options.vendor_id()) {
-          if (desc.idVendor != options.vendor_id()) {
-            is_match = false;
-          }
-        }
-
-        if (is_match && options.product_id()) {
-          if (desc.idProduct != options.product_id()) {
-            is_match = false;
-          }
-        }
-      }
-
-      if (is_match) {
-        m_device_list.push_back(Device(m_libusb_device_list[i]));
-      }
-    }
+  // Compares the bus with the previous rescan() by bus, port path and
+  // address and only reads the devices that arrived. device_list() is
+  // updated to match. Pass the same options each time, the first call and
+  // the first after get_device_list() report every matching device as added.
+  // With hotplug running both read the hotplug cache.
+  Rescan rescan(const SessionOptions &options);
+
+  // Opens a usbfs node such as /dev/bus/usb/001/005 directly when the caller
+  // already knows which device to use. Nothing is enumerated.
+  DeviceHandle open_device(
+    const var::StringView node_path,
+    int configuration,
+    const var::StringView interface_path);
 
-    return device_list();
+  // same as open_device() for a descriptor the caller keeps open, for
+  // example one inherited from a supervisor
+  DeviceHandle wrap_device(
+    int fd,
+    int configuration,
+    const var::StringView interface_path) {
+    API_RETURN_VALUE_IF_ERROR(DeviceHandle());
+    return Device::wrap_handle(m_context, fd, configuration, interface_path);
+  }
+
+  // Keeps a device cache up to date from hotplug arrivals and departures.
+  // get_device_list() then reads the cache instead of rescanning the bus and
+  // only newly arrived devices are opened to read their strings.
+  Session &start_hotplug(const SessionOptions &options = SessionOptions());
+  Session &stop_hotplug();
+  bool is_hotplug() const { return m_is_hotplug; }
+
+  // True if hotplug reported that `device` left since start_hotplug(). False
+  // if it is present or hotplug isn't running or doesn't watch it. Can be
+  // called from any thread, it doesn't handle events or send USB traffic.
+  bool is_departed(const Device &device);
+
+  // get_device_list() restores the strings of devices found in the file at
+  // `path` and reads the rest from the devices, then adds them to the file
+  Session &set_cache_path(const var::StringView path) {
+    m_enumeration_cache.open(path);
+    return *this;
+  }
+
+  // On Linux get_device_list() takes the strings the kernel already read
+  // from sysfs so listing devices doesn't open them. An empty path turns
+  // this off.
+  Session &set_sysfs_path(const var::StringView path) {
+    m_sysfs.set_path(path);
+    return *this;
   }
 
 private:
   API_ACCESS_COMPOUND(Session, DeviceList, device_list);
   libusb_context *m_context = nullptr;
+  IsDeviceDiscovery m_is_device_discovery;
   libusb_device **m_libusb_device_list = nullptr;
+  std::thread m_event_thread;
+  std::atomic<int> m_is_event_thread_stop{0};
+
+  bool m_is_hotplug = false;
+  libusb_hotplug_callback_handle m_hotplug_handle;
+  std::mutex m_hotplug_mutex;
+  class HotplugEvent {
+  public:
+    // holds a device reference until update_hotplug_cache()
+    libusb_device *device;
+    bool is_arrived;
+  };
+  var::Vector<HotplugEvent> m_hotplug_event_list;
+  DeviceList m_hotplug_device_list;
+  // every device that left until it arrives again or stop_hotplug(), holds
+  // a device reference and is guarded by m_hotplug_mutex
+  std::unordered_set<libusb_device *> m_departed_set;
+  // every device listed since it was connected, without hotplug
+  std::unordered_map<libusb_device *, Device> m_device_store;
+  class RescanEntry {
+  public:
+    // bus number, the port path padded with zeros then the address
+    u8 location[9];
+    bool is_match;
+    u16 vendor_id;
+    u16 product_id;
+    libusb_device *device;
+
+    bool operator<(const RescanEntry &a) const {
+      return memcmp(location, a.location, sizeof(location)) < 0;
+    }
+  };
+  // sorted by location
+  var::Vector<RescanEntry> m_rescan_list;
+  EnumerationCache m_enumeration_cache;
+  Sysfs m_sysfs;
+  DeviceSummaryTable m_summary_table;
+
+  void handle_events();
+  int init_context();
+  void update_device_list(const var::Vector<Device *> &match_list);
+  void update_summary_table(libusb_device *const *device_list, size_t count);
+  Device &get_stored_device(libusb_device *device);
+  Device *get_hotplug_device(libusb_device *device);
+  ssize_t load_libusb_device_list();
+  void update_hotplug_cache();
+
+  void
+  update_strings(const var::Vector<Device *> &device_list, u8 worker_count);
+
+  static void
+  load_strings(const var::Vector<Device *> &device_list, u8 worker_count);
+
+  static int LIBUSB_CALL handle_hotplug(
+    libusb_context *context,
+    libusb_device *device,
+    libusb_hotplug_event event,
+    void *user_data);
 
   void free_device_list() {
+    m_device_store.clear();
+    m_rescan_list.clear();
+    m_summary_table.clear();
     if (m_libusb_device_list != nullptr) {
       libusb_free_device_list(m_libusb_device_list, 1);
       m_libusb_device_list = nullptr;
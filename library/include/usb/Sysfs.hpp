@@ -0,0 +1,84 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#ifndef USBAPI_SYSFS_HPP
+#define USBAPI_SYSFS_HPP
+
+#include <var/Data.hpp>
+#include <var/String.hpp>
+#include <var/Vector.hpp>
+
+#include "Device.hpp"
+
+namespace usb {
+
+// Reads the attributes Linux exposes for each USB device under
+// /sys/bus/usb/devices. The strings the kernel read at enumeration are
+// available there without opening the device. The root is a parameter so
+// a copy of the tree can stand in for /sys.
+class Sysfs {
+public:
+  class Entry {
+    API_AC(Entry, var::String, name);
+    API_AF(Entry, u8, bus_number, 0);
+    API_AF(Entry, u8, device_address, 0);
+    API_AC(Entry, var::Vector<u8>, port_path);
+    API_AF(Entry, u16, vendor_id, 0);
+    API_AF(Entry, u16, product_id, 0);
+    API_AF(Entry, u16, bcd_device, 0);
+    // by descriptor index, empty where sysfs doesn't have the string
+    API_AC(Entry, var::StringList, string_list);
+  };
+
+  explicit Sysfs(const var::StringView path = "/sys/bus/usb/devices")
+    : m_path(path) {}
+
+  Sysfs &set_path(const var::StringView path) {
+    m_path = var::String(path);
+    m_entry_list.clear();
+    return *this;
+  }
+
+  const var::String &path() const { return m_path; }
+
+  // rescans the directory, an empty or missing one leaves no entries
+  Sysfs &load();
+  // adds the entry of one device directory such as 1-1.2 without listing
+  // the others
+  Sysfs &load(const var::StringView name);
+  Sysfs &clear() {
+    m_entry_list.clear();
+    return *this;
+  }
+
+  const var::Vector<Entry> &entry_list() const { return m_entry_list; }
+
+  const Entry *find(u8 bus_number, u8 device_address) const;
+
+  // Copies the strings of the matching entry into `device`. False unless
+  // that covers every string the device references, sysfs only lists the
+  // active configuration.
+  bool restore(Device &device) const;
+
+  // the directory name of `device`, <bus>-<port>.<port>... or usb<bus> for
+  // a root hub
+  static var::String get_name(libusb_device *device);
+
+private:
+  var::String m_path;
+  var::Vector<Entry> m_entry_list;
+
+  Entry load_entry(const var::StringView name) const;
+  var::String read_attribute(
+    const var::StringView name,
+    const var::StringView attribute) const;
+  var::Data read_file(const var::String &path) const;
+  var::StringList read_directory() const;
+  void
+  load_interface_strings(Entry &entry, const var::Data &descriptors) const;
+
+  static var::Vector<u8> get_port_path(const var::StringView name);
+};
+
+} // namespace usb
+
+#endif // USBAPI_SYSFS_HPP
@@ -0,0 +1,148 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#ifndef USBAPI_TRANSFER_HPP
+#define USBAPI_TRANSFER_HPP
+
+#include <chrono/MicroTime.hpp>
+#include <var/Data.hpp>
+#include <var/Vector.hpp>
+
+#include "Descriptor.hpp"
+
+namespace usb {
+
+// One asynchronous transfer. The callback runs on whichever thread handles
+// libusb events, normally the Session event thread.
+class Transfer : public UsbFlags {
+public:
+  using callback_t = void (*)(void *context, Transfer *transfer);
+
+  class Construct {
+    API_AF(Construct, libusb_context *, context, nullptr);
+    API_AF(Construct, libusb_device_handle *, handle, nullptr);
+    API_AF(Construct, u8, address, 0);
+    API_AF(Construct, TransferType, transfer_type, TransferType::bulk);
+    API_AF(Construct, u32, size, 0);
+    API_AC(Construct, chrono::MicroTime, timeout);
+    API_AF(Construct, callback_t, callback, nullptr);
+    API_AF(Construct, void *, callback_context, nullptr);
+  };
+
+  explicit Transfer(const Construct &options);
+  ~Transfer();
+
+  Transfer(const Transfer &) = delete;
+  Transfer &operator=(const Transfer &) = delete;
+
+  bool is_valid() const { return m_transfer != nullptr; }
+  bool is_pending() const { return m_is_complete == 0; }
+  u8 address() const { return m_address; }
+
+  var::Data &data() { return m_data; }
+  const var::Data &data() const { return m_data; }
+  int actual_length() const { return m_transfer->actual_length; }
+  int error() const { return get_error(m_transfer); }
+
+  int submit() { return submit(m_data.size()); }
+  int submit(int length);
+  int cancel();
+  int wait(const chrono::MicroTime &timeout) {
+    return wait(m_context, &m_is_complete, timeout);
+  }
+
+  // handles events on `context` until `*is_complete` is set, zero waits
+  // forever
+  static int wait(
+    libusb_context *context,
+    int *is_complete,
+    const chrono::MicroTime &timeout);
+
+  static int get_error(const libusb_transfer *transfer);
+
+private:
+  libusb_context *m_context = nullptr;
+  libusb_device_handle *m_handle = nullptr;
+  libusb_transfer *m_transfer = nullptr;
+  u8 m_address = 0;
+  TransferType m_transfer_type;
+  chrono::MicroTime m_timeout;
+  callback_t m_callback = nullptr;
+  void *m_callback_context = nullptr;
+  int m_is_complete = 1;
+  // set once the completion callback has returned
+  int m_is_callback_done = 1;
+  var::Data m_data;
+
+  static void LIBUSB_CALL handle_transfer_complete(libusb_transfer *transfer);
+};
+
+// Keeps up to `depth` asynchronous bulk transfers in flight on one endpoint.
+// IN queues are primed on construction and resubmit each transfer as soon as
+// its data has been consumed. OUT queues copy the caller data into free
+// transfers and return once it is queued; errors are reported on the next
+// write() or flush().
+class TransferQueue : public UsbFlags {
+public:
+  class Construct {
+    API_AF(Construct, libusb_context *, context, nullptr);
+    API_AF(Construct, libusb_device_handle *, handle, nullptr);
+    API_AF(Construct, u8, address, 0);
+    API_AF(Construct, u8, depth, 4);
+    API_AF(Construct, u16, max_packet_size, 64);
+    API_AF(Construct, u32, transfer_size, 16384);
+  };
+
+  explicit TransferQueue(const Construct &options);
+  ~TransferQueue();
+
+  TransferQueue(const TransferQueue &) = delete;
+  TransferQueue &operator=(const TransferQueue &) = delete;
+
+  bool is_valid() const { return m_slot_list.count() > 0; }
+  bool is_direction_in() const { return m_address & 0x80; }
+  u8 address() const { return m_address; }
+  u8 depth() const { return m_slot_list.count(); }
+
+  int read(void *buf, int nbyte, const chrono::MicroTime &timeout);
+  int write(const void *buf, int nbyte, const chrono::MicroTime &timeout);
+  int flush(const chrono::MicroTime &timeout);
+
+private:
+  class Slot {
+  public:
+    libusb_transfer *transfer = nullptr;
+    var::Data buffer;
+    int offset = 0;
+    int is_complete = 1;
+  };
+
+  libusb_context *m_context = nullptr;
+  libusb_device_handle *m_handle = nullptr;
+  u8 m_address = 0;
+  u16 m_max_packet_size = 0;
+  u8 m_head = 0;
+  u8 m_pending_count = 0;
+  int m_error = 0;
+  var::Vector<Slot> m_slot_list;
+
+  Slot &head() { return m_slot_list.at(m_head); }
+  Slot &tail() {
+    return m_slot_list.at((m_head + m_pending_count) % m_slot_list.count());
+  }
+
+  int prime();
+  int release();
+  int submit(Slot &slot, int length, const chrono::MicroTime &timeout);
+  int queue(const u8 *data, int size, const chrono::MicroTime &timeout);
+  int wait(Slot &slot, const chrono::MicroTime &timeout) {
+    return Transfer::wait(m_context, &slot.is_complete, timeout);
+  }
+  int poll();
+  void cancel();
+
+  static void LIBUSB_CALL handle_transfer_complete(libusb_transfer *transfer);
+};
+
+} // namespace usb
+
+#endif // USBAPI_TRANSFER_HPP
@@ -22,6 +22,12 @@ void usb_link_transport_driver_flush(link_transport_phy_t handle);
 void usb_link_transport_driver_request(link_transport_phy_t handle);
 
 int usb_link_transport_getname(char * dest, const char * last, int len);
+
+// Scans the bus once and copies up to `count` link paths into `dest`, one
+// every `path_max` bytes. Returns the number of paths found, which can be
+// more than `count`.
+int usb_link_transport_get_path_list(char * dest, int path_max, int count);
+
 int usb_link_transport_lock(link_transport_phy_t handle);
 int usb_link_transport_unlock(link_transport_phy_t handle);
 int usb_link_transport_status(link_transport_phy_t handle);
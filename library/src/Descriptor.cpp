@@ -6,6 +6,155 @@
 
 using namespace usb;
 
+const var::String &DescriptorStringList::at(u8 index) const {
+  if (index == 0) {
+    static const var::String null_string("(null)");
+    return null_string;
+  }
+
+  if (is_fetched(index) == false) {
+    fetch(var::Vector<u8>().push_back(index));
+  }
+
+  if (index < m_list.count()) {
+    return m_list.at(index);
+  }
+  return var::String::empty_string();
+}
+
+DescriptorStringList &
+DescriptorStringList::set(u8 index, const var::StringView value) {
+  if (index == 0) {
+    return *this;
+  }
+  if (m_list.count() <= index) {
+    m_list.resize(index + 1);
+  }
+  m_list.at(index) = var::String(value);
+  m_is_fetched[index / 32] |= 1u << (index % 32);
+  return *this;
+}
+
+const DescriptorStringList &DescriptorStringList::load() const {
+  if (m_is_loaded == false) {
+    m_is_loaded = fetch(get_referenced_index_list());
+  }
+  return *this;
+}
+
+bool DescriptorStringList::check_loaded() const {
+  if (m_is_loaded == false) {
+    bool result = true;
+    for (u8 index : get_referenced_index_list()) {
+      result = result && (index == 0 || is_fetched(index));
+    }
+    m_is_loaded = result;
+  }
+  return m_is_loaded;
+}
+
+bool DescriptorStringList::fetch(const var::Vector<u8> &index_list) const {
+  var::Vector<u8> pending_list;
+  for (u8 index : index_list) {
+    if (index && !is_fetched(index)) {
+      pending_list.push_back(index);
+    }
+  }
+
+  if (pending_list.count() == 0) {
+    return true;
+  }
+
+  if (m_device == nullptr) {
+    return false;
+  }
+
+  libusb_device_handle *device_handle;
+  if (libusb_open(m_device, &device_handle) != LIBUSB_SUCCESS) {
+    return false;
+  }
+
+  u8 buffer[255];
+  // one language request instead of one per string as
+  // libusb_get_string_descriptor_ascii() does
+  u16 language_id = 0;
+  if (
+    libusb_get_string_descriptor(device_handle, 0, 0, buffer, sizeof(buffer))
+    >= 4) {
+    language_id = buffer[2] | (buffer[3] << 8);
+  }
+
+  bool is_complete = true;
+  for (u8 index : pending_list) {
+    int result = libusb_get_string_descriptor(
+      device_handle,
+      index,
+      language_id,
+      buffer,
+      sizeof(buffer));
+
+    if (result < 2 || buffer[1] != LIBUSB_DT_STRING) {
+      // asked for again next time
+      is_complete = false;
+      continue;
+    }
+
+    if (result > buffer[0]) {
+      result = buffer[0];
+    }
+
+    // same ASCII conversion as libusb_get_string_descriptor_ascii()
+    char ascii[sizeof(buffer) / 2];
+    int length = 0;
+    for (int i = 2; i + 1 < result; i += 2) {
+      ascii[length++]
+        = (buffer[i + 1] || (buffer[i] & 0x80)) ? '?' : char(buffer[i]);
+    }
+
+    if (m_list.count() <= index) {
+      m_list.resize(index + 1);
+    }
+    m_list.at(index) = var::String(ascii, length);
+    m_is_fetched[index / 32] |= 1u << (index % 32);
+  }
+
+  libusb_close(device_handle);
+  return is_complete;
+}
+
+var::Vector<u8> DescriptorStringList::get_referenced_index_list() const {
+  var::Vector<u8> result;
+  if (m_device == nullptr) {
+    return result;
+  }
+
+  libusb_device_descriptor device_descriptor;
+  if (libusb_get_device_descriptor(m_device, &device_descriptor) < 0) {
+    return result;
+  }
+
+  result.push_back(device_descriptor.iManufacturer);
+  result.push_back(device_descriptor.iProduct);
+  result.push_back(device_descriptor.iSerialNumber);
+
+  for (u8 i = 0; i < device_descriptor.bNumConfigurations; i++) {
+    libusb_config_descriptor *config = nullptr;
+    if (libusb_get_config_descriptor(m_device, i, &config) < 0) {
+      continue;
+    }
+    result.push_back(config->iConfiguration);
+    for (u8 j = 0; j < config->bNumInterfaces; j++) {
+      const libusb_interface &iface = config->interface[j];
+      for (int k = 0; k < iface.num_altsetting; k++) {
+        result.push_back(iface.altsetting[k].iInterface);
+      }
+    }
+    libusb_free_config_descriptor(config);
+  }
+
+  return result;
+}
+
 DeviceDescriptor::DeviceDescriptor(
   const libusb_device_descriptor &value,
   const DescriptorStringList &string_list)
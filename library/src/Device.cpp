@@ -1,5 +1,11 @@
 // Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
 
+#include <cctype>
+
+#if !defined __win32
+#include <unistd.h>
+#endif
+
 #include <var.hpp>
 
 #include "usb/Device.hpp"
@@ -8,79 +14,333 @@ using namespace usb;
 
 Endpoint Endpoint::m_empty_endpoint;
 
-Device::Device(libusb_device *device) {
+Device::Device(libusb_device *device, libusb_context *context)
+  : m_cache(std::make_shared<Cache>(device)) {
   m_device = device;
-  load_strings();
+  m_context = context;
 }
 
 DeviceDescriptor Device::get_device_descriptor() const {
   API_ASSERT(m_device != nullptr);
-  struct libusb_device_descriptor descriptor = {0};
-  if (is_success()) {
-    API_SYSTEM_CALL("", libusb_get_device_descriptor(m_device, &descriptor));
+  if (m_cache->is_device_descriptor_loaded == false && is_success()) {
+    API_SYSTEM_CALL(
+      "Device::libusb_get_device_descriptor",
+      libusb_get_device_descriptor(m_device, &m_cache->device_descriptor));
+    m_cache->is_device_descriptor_loaded = is_success();
   }
-  return DeviceDescriptor(descriptor, m_string_list);
+  return DeviceDescriptor(m_cache->device_descriptor, m_cache->string_list);
 }
 
 ConfigurationDescriptor
 Device::get_configuration_descriptor(int configuration_number) const {
   API_ASSERT(m_device != nullptr);
-  return ConfigurationDescriptor(m_device, configuration_number, m_string_list);
+  API_ASSERT(configuration_number >= 0 && configuration_number < 256);
+  var::Vector<ConfigurationPointer> &configuration_list
+    = m_cache->configuration_list;
+  if (configuration_list.count() <= size_t(configuration_number)) {
+    configuration_list.resize(configuration_number + 1);
+  }
+
+  ConfigurationPointer &configuration
+    = configuration_list.at(configuration_number);
+  if (!configuration && is_success()) {
+    libusb_config_descriptor *descriptor = nullptr;
+    API_SYSTEM_CALL(
+      "Device::libusb_get_config_descriptor",
+      libusb_get_config_descriptor(
+        m_device,
+        configuration_number,
+        &descriptor));
+    if (descriptor != nullptr) {
+      configuration.reset(descriptor, libusb_free_config_descriptor);
+    }
+  }
+  return ConfigurationDescriptor(configuration, m_cache->string_list);
 }
 
 ConfigurationDescriptor Device::get_active_configuration_descriptor() const {
   API_ASSERT(m_device != nullptr);
-  return ConfigurationDescriptor(m_device, m_string_list);
+  ConfigurationPointer &configuration = m_cache->active_configuration;
+  if (!configuration && is_success()) {
+    libusb_config_descriptor *descriptor = nullptr;
+    API_SYSTEM_CALL(
+      "Device::libusb_get_active_config_descriptor",
+      libusb_get_active_config_descriptor(m_device, &descriptor));
+    if (descriptor != nullptr) {
+      configuration.reset(descriptor, libusb_free_config_descriptor);
+    }
+  }
+  return ConfigurationDescriptor(configuration, m_cache->string_list);
 }
 
-void Device::load_strings() {
-  API_RETURN_IF_ERROR();
-  libusb_device_handle *device_handle;
-  if (libusb_open(m_device, &device_handle) == LIBUSB_SUCCESS) {
-    var::Array<u8, 255> buffer;
-    int idx = 1;
-    int result;
-
-    m_string_list.reserve(16);
-    // strings start at 1 -- 0 is invalid
-    m_string_list.push_back(String("(null)"));
-
-    do {
-      View(buffer).fill(0);
-      result = libusb_get_string_descriptor_ascii(
-        device_handle,
-        idx++,
-        View(buffer).to_u8(),
-        View(buffer).size());
-      if (result > 0) {
+Device &Device::invalidate_descriptors() {
+  // copies see the change too
+  *m_cache = Cache(m_device);
+  return *this;
+}
+
+bool Device::is_stratify_os() const {
+  if (m_cache->stratify_os_state != StratifyOsState::unknown) {
+    return m_cache->stratify_os_state == StratifyOsState::yes;
+  }
 
-        m_string_list.push_back(var::String(View(buffer).to_char(), result));
+  bool result = false;
+  for (const var::String &entry : string_list()) {
+    if (contains_ignore_case(entry.string_view(), "stratify")) {
+      result = true;
+      break;
+    }
+  }
+
+  if (result == false) {
+    const ConfigurationDescriptor configuration
+      = get_configuration_descriptor(0);
+    if (is_error()) {
+      // try again next time
+      return false;
+    }
+
+    for (const Interface iface : configuration.interfaces()) {
+      for (const InterfaceDescriptor iface_descriptor :
+           iface.alternate_settings()) {
+        result = result || is_stratify_os(iface_descriptor);
       }
+    }
+  }
 
-    } while ((result > 0) && (idx < 256));
+  m_cache->stratify_os_state
+    = result ? StratifyOsState::yes : StratifyOsState::no;
+  return result;
+}
 
-    libusb_close(device_handle);
+bool Device::is_stratify_os(const InterfaceDescriptor &interface_descriptor) {
+  if (
+    (interface_descriptor.interface_class() == 0xff)
+    && (interface_descriptor.interface_sub_class() == 0x50)
+    && (interface_descriptor.interface_protocol() == 0x51)) {
+    return true;
+  }
+
+  return contains_ignore_case(
+    interface_descriptor.interface_string().string_view(),
+    "stratify");
+}
+
+bool Device::contains_ignore_case(
+  const var::StringView string,
+  const var::StringView value) {
+  if (value.length() > string.length()) {
+    return false;
+  }
+
+  for (size_t i = 0; i + value.length() <= string.length(); i++) {
+    size_t j = 0;
+    while (j < value.length()
+           && tolower(static_cast<unsigned char>(string.at(i + j)))
+                == value.at(j)) {
+      j++;
+    }
+    if (j == value.length()) {
+      return true;
+    }
   }
+  return false;
+}
+
+DeviceHandle Device::wrap_handle(
+  libusb_context *context,
+  int fd,
+  int configuration,
+  const var::StringView path,
+  bool is_fd_owned) {
+  libusb_device_handle *handle = nullptr;
+  if (
+    API_SYSTEM_CALL(
+      "Device::libusb_wrap_sys_device",
+      libusb_wrap_sys_device(context, fd, &handle))
+    < 0) {
+#if !defined __win32
+    if (is_fd_owned) {
+      ::close(fd);
+    }
+#endif
+    return DeviceHandle();
+  }
+
+  const Device device(libusb_get_device(handle), context);
+  DeviceHandle result(handle, &device, configuration, path);
+  // the handle closes this after libusb_close() even if opening failed
+  result.m_wrapped_fd = is_fd_owned ? fd : -1;
+  return result;
 }
 
 Device *DeviceList::find(const Find &options) {
-  for (auto &device : *this) {
-    DeviceDescriptor device_descriptor = device.get_device_descriptor();
-
-    if (
-      (device_descriptor.vendor_id() == options.vendor_id())
-      && (device_descriptor.product_id() == options.product_id())) {
-
-      if (options.serial_number().is_empty()) {
-        return &device;
-      } else if (
-        device_descriptor.serial_number_string() == options.serial_number()) {
-        return &device;
+  if (is_index_current() == false) {
+    update_index();
+  }
+  return find_serial_number(
+    get_product_key(options.vendor_id(), options.product_id()),
+    options.serial_number());
+}
+
+Device *DeviceList::find_serial_number(
+  u32 product_key,
+  const var::StringView serial) {
+  const auto entry = m_product_index.find(product_key);
+  if (entry == m_product_index.end()) {
+    return nullptr;
+  }
+
+  if (serial.is_empty()) {
+    return &at(entry->second.front());
+  }
+
+  if (m_serial_indexed_product_set.count(product_key) == 0) {
+    for (u32 position : entry->second) {
+      const u64 key
+        = (u64(product_key) << 32)
+          | get_serial_hash(
+            at(position).get_device_descriptor().serial_number_string());
+      // the first device keeps the slot like the linear scan did
+      m_serial_index.emplace(key, position);
+    }
+    m_serial_indexed_product_set.insert(product_key);
+  }
+
+  const auto match
+    = m_serial_index.find((u64(product_key) << 32) | get_serial_hash(serial));
+  if (match == m_serial_index.end()) {
+    return nullptr;
+  }
+
+  Device &device = at(match->second);
+  // a hash collision is possible, the string decides
+  if (device.get_device_descriptor().serial_number_string() != serial) {
+    for (u32 position : entry->second) {
+      Device &candidate = at(position);
+      if (
+        candidate.get_device_descriptor().serial_number_string() == serial) {
+        return &candidate;
       }
     }
+    return nullptr;
+  }
+  return &device;
+}
+
+DeviceList &DeviceList::update_index() {
+  m_product_index.clear();
+  m_serial_index.clear();
+  m_serial_indexed_product_set.clear();
+
+  for (u32 i = 0; i < count(); i++) {
+    const DeviceDescriptor descriptor = at(i).get_device_descriptor();
+    m_product_index[get_product_key(
+                      descriptor.vendor_id(),
+                      descriptor.product_id())]
+      .push_back(i);
   }
 
-  return nullptr;
+  m_indexed_data = data();
+  m_indexed_count = count();
+  m_indexed_generation = m_generation;
+  return *this;
+}
+
+u32 DeviceList::get_serial_hash(const var::StringView serial_number) {
+  // FNV-1a
+  u32 result = 2166136261u;
+  for (size_t i = 0; i < serial_number.length(); i++) {
+    result = (result ^ u8(serial_number.data()[i])) * 16777619u;
+  }
+  return result;
+}
+
+DeviceHandle::DeviceHandle(
+  libusb_device_handle *handle,
+  const Device *device,
+  int configuration,
+  const var::StringView name) {
+  set_device(device);
+  m_handle = handle;
+  // setting the configuration costs a control transfer and can rebind
+  // kernel drivers even when nothing changes
+  if (
+    (configuration != keep_configuration)
+    && (is_configuration_active(configuration) == false)) {
+    set_configuration(configuration);
+  }
+  open(name, fs::OpenMode::read_write());
+}
+
+DeviceHandle &DeviceHandle::set_device(const Device *device) {
+  if (device == nullptr) {
+    m_device.reset();
+  } else {
+    m_device = std::make_shared<Device>(*device);
+  }
+  return *this;
+}
+
+bool DeviceHandle::is_configuration_active(int configuration_number) {
+  // libusb reports an unconfigured device as configuration 0
+  if (configuration_number == unconfigure) {
+    configuration_number = 0;
+  }
+
+  if (
+    (configuration_number > 0) && (m_device != nullptr)
+    && (m_device->active_configuration_value() == configuration_number)) {
+    return true;
+  }
+
+  // a failure isn't an error here, libusb_set_configuration() will report it
+  int active_configuration = 0;
+  if (libusb_get_configuration(m_handle, &active_configuration) < 0) {
+    return false;
+  }
+  return active_configuration == configuration_number;
+}
+
+void DeviceHandle::close() {
+  if (m_handle) {
+    finalize_transfer_queues();
+    libusb_device_handle *handle = m_handle;
+    release_interface();
+    m_handle = nullptr;
+    libusb_close(handle);
+  }
+
+#if !defined __win32
+  if (m_wrapped_fd >= 0) {
+    ::close(m_wrapped_fd);
+  }
+#endif
+  m_wrapped_fd = -1;
+  m_device.reset();
+}
+
+DeviceHandle &DeviceHandle::set_configuration(int configuration_number) {
+  API_RETURN_VALUE_IF_ERROR(*this);
+  API_SYSTEM_CALL(
+    "DeviceHandle::libusb_set_configuration",
+    libusb_set_configuration(m_handle, configuration_number));
+  if (m_device != nullptr) {
+    m_device->invalidate_active_configuration();
+  }
+  return *this;
+}
+
+DeviceHandle &DeviceHandle::reset() {
+  API_RETURN_VALUE_IF_ERROR(*this);
+  API_SYSTEM_CALL(
+    "DeviceHandle::libusb_reset_device",
+    libusb_reset_device(m_handle));
+  if (m_device != nullptr) {
+    // the device may come back with different descriptors
+    m_device->invalidate_descriptors();
+  }
+  return *this;
 }
 
 void DeviceHandle::load_endpoint_list() {
@@ -88,67 +348,150 @@ void DeviceHandle::load_endpoint_list() {
   ConfigurationDescriptor configuration
     = m_device->get_active_configuration_descriptor();
   m_endpoint_list.clear();
-  for (const Interface &interface : configuration.interface_list()) {
-    for (const InterfaceDescriptor &alternate_setting :
-         interface.alternate_settings_list()) {
+  for (auto &entry : m_endpoint_table) {
+    entry[0] = Endpoint();
+    entry[1] = Endpoint();
+  }
+
+  for (const Interface interface : configuration.interfaces()) {
+    for (const InterfaceDescriptor alternate_setting :
+         interface.alternate_settings()) {
       if (alternate_setting.interface_number() == m_interface_number) {
-        for (const EndpointDescriptor &endpoint :
-             alternate_setting.endpoint_list()) {
+        for (const EndpointDescriptor endpoint :
+             alternate_setting.endpoints()) {
 
           m_endpoint_list.push_back(Endpoint(endpoint).set_interface(
             alternate_setting.interface_number()));
+
+          // the first alternate setting that uses an endpoint owns it
+          const Endpoint &loaded = m_endpoint_list.back();
+          Endpoint &entry
+            = m_endpoint_table[loaded.number()][loaded.is_direction_in()];
+          if (entry.is_valid() == false) {
+            entry = loaded;
+          }
         }
       }
     }
   }
+
+  for (u8 i = 0; i < endpoint_count; i++) {
+    const Endpoint &endpoint = get_endpoint(i, true);
+    m_read_buffer_table[i].set_capacity(
+      endpoint.is_valid() ? endpoint.max_packet_size() * 4 : 0);
+  }
 }
 
-const Endpoint &DeviceHandle::find_endpoint(u8 address) const {
-  for (const auto &ep : m_endpoint_list) {
-    if (ep.address() == (address & 0x7f)) {
-      return ep;
-    }
+TransferQueue *
+DeviceHandle::get_transfer_queue(const Endpoint &endpoint, bool is_read) const {
+  if (
+    (m_queue_depth == 0)
+    || (endpoint.transfer_type() != TransferType::bulk)) {
+    return nullptr;
+  }
+
+  std::unique_ptr<TransferQueue> &queue
+    = m_transfer_queue_table[endpoint.number()][is_read];
+  if (queue) {
+    return queue.get();
+  }
+
+  queue.reset(new TransferQueue(
+    TransferQueue::Construct()
+      .set_context(m_device ? m_device->context() : nullptr)
+      .set_handle(m_handle)
+      .set_address(
+        is_read ? endpoint.read_address() : endpoint.write_address())
+      .set_depth(m_queue_depth)
+      .set_max_packet_size(endpoint.max_packet_size())
+      .set_transfer_size(m_transfer_size ? m_transfer_size : 16384)));
+
+  if (queue->is_valid() == false) {
+    queue.reset();
+    return nullptr;
   }
 
-  return Endpoint::empty();
+  return queue.get();
+}
+
+void DeviceHandle::finalize_transfer_queues() {
+  for (auto &entry : m_transfer_queue_table) {
+    for (auto &queue : entry) {
+      if (queue) {
+        // a zero timeout would wait forever on a device that stopped reading
+        queue->flush(
+          m_timeout.microseconds() > 0
+            ? chrono::MicroTime(m_timeout.microseconds() * 4)
+            : chrono::MicroTime(1000000));
+        // cancels anything still in flight before the interface is released
+        queue.reset();
+      }
+    }
+  }
 }
 
 int DeviceHandle::interface_read(void *buf, int nbyte) const {
 
-  const Endpoint endpoint = find_endpoint(m_location);
+  const Endpoint &endpoint = get_endpoint(m_location, true);
 
-  DeviceReadBuffer *read_buffer = nullptr;
-  for (DeviceReadBuffer &buffer : m_read_buffer_list) {
-    if (buffer.address() == endpoint.address()) {
-      read_buffer = &buffer;
-      break;
-    }
+  TransferQueue *queue = get_transfer_queue(endpoint, true);
+  if (queue != nullptr) {
+    API_RETURN_VALUE_IF_ERROR(-1);
+    const int result = API_SYSTEM_CALL(
+      "DeviceHandle::TransferQueue::read",
+      queue->read(
+        buf,
+        nbyte,
+        chrono::MicroTime(m_timeout.microseconds() * 4)));
+    m_is_disconnected
+      = m_is_disconnected || (result == LIBUSB_ERROR_NO_DEVICE);
+    return result;
   }
 
-  if (read_buffer == nullptr) {
-    m_read_buffer_list.push_back(
-      DeviceReadBuffer().set_address(endpoint.address()));
-    read_buffer = &m_read_buffer_list.back();
-    read_buffer->buffer().reserve(endpoint.max_packet_size());
+  if (endpoint.is_valid() == false) {
+    return -1;
   }
 
+  DeviceReadBuffer *read_buffer = m_read_buffer_table + (m_location & 0x0f);
+
+  const int max_packet_size = endpoint.max_packet_size();
+
   // are there bytes left in the buffer
   int bytes_read = 0;
   while (bytes_read < nbyte) {
     bytes_read += read_buffer->copy_and_erase_bytes(
       static_cast<char *>(buf) + bytes_read,
       nbyte - bytes_read);
-    if (bytes_read < nbyte) {
-      read_buffer->buffer().resize(endpoint.max_packet_size());
+
+    const int bytes_remaining = nbyte - bytes_read;
+    if (bytes_remaining >= max_packet_size) {
+      // whole packets go straight to the caller, only the tail is staged
       int result = transfer(
         endpoint,
-        read_buffer->buffer().data(),
-        read_buffer->buffer().size(),
+        static_cast<char *>(buf) + bytes_read,
+        bytes_remaining - bytes_remaining % max_packet_size,
         true);
       if (result > 0) {
-        read_buffer->buffer().resize(result);
+        bytes_read += result;
+      } else {
+        if (bytes_read > 0) {
+          return bytes_read;
+        }
+        return result;
+      }
+    } else if (bytes_remaining > 0) {
+      // stage as many whole packets as fit, one page at most
+      const int page_size = get_page_size(endpoint);
+      int staging_size = read_buffer->tail_size()
+                         - read_buffer->tail_size() % max_packet_size;
+      if (staging_size > page_size) {
+        staging_size = page_size;
+      }
+      int result
+        = transfer(endpoint, read_buffer->tail_data(), staging_size, true);
+      if (result > 0) {
+        read_buffer->push(result);
       } else {
-        read_buffer->buffer().resize(0);
         if (bytes_read > 0) {
           return bytes_read;
         }
@@ -161,7 +504,22 @@ int DeviceHandle::interface_read(void *buf, int nbyte) const {
 }
 
 int DeviceHandle::interface_write(const void *buf, int nbyte) const {
-  const Endpoint endpoint = find_endpoint(m_location);
+  const Endpoint &endpoint = get_endpoint(m_write_location, false);
+
+  TransferQueue *queue = get_transfer_queue(endpoint, false);
+  if (queue != nullptr) {
+    API_RETURN_VALUE_IF_ERROR(-1);
+    const int result = API_SYSTEM_CALL(
+      "DeviceHandle::TransferQueue::write",
+      queue->write(
+        buf,
+        nbyte,
+        chrono::MicroTime(m_timeout.microseconds() * 4)));
+    m_is_disconnected
+      = m_is_disconnected || (result == LIBUSB_ERROR_NO_DEVICE);
+    return result;
+  }
+
   const int result = transfer(endpoint, (void *)buf, nbyte, false);
   return result;
 }
@@ -180,13 +538,14 @@ int DeviceHandle::transfer(
   int result;
   int bytes_transferred = 0;
   const int max_packet_size = endpoint.max_packet_size();
+  const int max_page_size = get_page_size(endpoint);
   int page_size;
   u8 *p = static_cast<u8 *>(buf);
 
   do {
 
-    if (nbyte - bytes_transferred > max_packet_size) {
-      page_size = max_packet_size;
+    if (nbyte - bytes_transferred > max_page_size) {
+      page_size = max_page_size;
     } else {
       page_size = nbyte - bytes_transferred;
     }
@@ -199,16 +558,29 @@ int DeviceHandle::transfer(
       return result;
     }
 
-  } while ((bytes_transferred < nbyte) && (result == max_packet_size));
+  } while ((bytes_transferred < nbyte) && (result == page_size));
 
-  // send a zero length packet??
-  if (!is_read && (result == max_packet_size)) {
+  // send a zero length packet if the last packet was full
+  if (
+    !is_read && (result == page_size)
+    && (bytes_transferred % max_packet_size) == 0) {
     transfer_packet(endpoint, nullptr, 0, is_read);
   }
 
   return bytes_transferred;
 }
 
+int DeviceHandle::get_page_size(const Endpoint &endpoint) const {
+  const u32 max_packet_size = endpoint.max_packet_size();
+  const u32 transfer_size
+    = m_transfer_size > 0x7fffffff ? 0x7fffffff : m_transfer_size;
+  if (transfer_size <= max_packet_size) {
+    return max_packet_size;
+  }
+  // whole packets so a read into the page can never overflow
+  return transfer_size - transfer_size % max_packet_size;
+}
+
 int DeviceHandle::transfer_packet(
   const Endpoint &endpoint,
   void *buf,
@@ -266,5 +638,8 @@ int DeviceHandle::transfer_packet(
     return transferred;
   }
 
+  if (result == LIBUSB_ERROR_NO_DEVICE) {
+    m_is_disconnected = true;
+  }
   return result;
 }
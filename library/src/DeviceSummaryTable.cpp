@@ -0,0 +1,84 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#include "usb/DeviceSummaryTable.hpp"
+
+using namespace usb;
+
+DeviceSummaryTable &DeviceSummaryTable::clear() {
+  for (libusb_device *device : m_device_list) {
+    libusb_unref_device(device);
+  }
+  m_vendor_id_list.clear();
+  m_product_id_list.clear();
+  m_device_class_list.clear();
+  m_device_sub_class_list.clear();
+  m_bus_number_list.clear();
+  m_device_address_list.clear();
+  m_device_list.clear();
+  return *this;
+}
+
+DeviceSummaryTable &DeviceSummaryTable::reserve(size_t count) {
+  m_vendor_id_list.reserve(count);
+  m_product_id_list.reserve(count);
+  m_device_class_list.reserve(count);
+  m_device_sub_class_list.reserve(count);
+  m_bus_number_list.reserve(count);
+  m_device_address_list.reserve(count);
+  m_device_list.reserve(count);
+  return *this;
+}
+
+DeviceSummaryTable &DeviceSummaryTable::push_back(libusb_device *device) {
+  libusb_device_descriptor descriptor = {0};
+  libusb_get_device_descriptor(device, &descriptor);
+  m_vendor_id_list.push_back(descriptor.idVendor);
+  m_product_id_list.push_back(descriptor.idProduct);
+  m_device_class_list.push_back(descriptor.bDeviceClass);
+  m_device_sub_class_list.push_back(descriptor.bDeviceSubClass);
+  m_bus_number_list.push_back(libusb_get_bus_number(device));
+  m_device_address_list.push_back(libusb_get_device_address(device));
+  m_device_list.push_back(libusb_ref_device(device));
+  return *this;
+}
+
+var::Vector<u32> DeviceSummaryTable::find(const Query &query) const {
+  const size_t row_count = count();
+  m_match_list.resize(row_count);
+
+  // a zero query field masks the column out so every row compares equal
+  const u16 vendor_id_mask = query.vendor_id() ? 0xffff : 0;
+  const u16 product_id_mask = query.product_id() ? 0xffff : 0;
+  const u8 device_class_mask = query.device_class() ? 0xff : 0;
+  const u8 device_sub_class_mask = query.device_sub_class() ? 0xff : 0;
+  const u8 bus_number_mask = query.bus_number() ? 0xff : 0;
+  const u8 device_address_mask = query.device_address() ? 0xff : 0;
+
+  const u16 *vendor_id = m_vendor_id_list.data();
+  const u16 *product_id = m_product_id_list.data();
+  const u8 *device_class = m_device_class_list.data();
+  const u8 *device_sub_class = m_device_sub_class_list.data();
+  const u8 *bus_number = m_bus_number_list.data();
+  const u8 *device_address = m_device_address_list.data();
+  u8 *match = m_match_list.data();
+
+  for (size_t i = 0; i < row_count; i++) {
+    match[i]
+      = ((vendor_id[i] & vendor_id_mask) == query.vendor_id())
+        & ((product_id[i] & product_id_mask) == query.product_id())
+        & ((device_class[i] & device_class_mask) == query.device_class())
+        & ((device_sub_class[i] & device_sub_class_mask)
+           == query.device_sub_class())
+        & ((bus_number[i] & bus_number_mask) == query.bus_number())
+        & ((device_address[i] & device_address_mask)
+           == query.device_address());
+  }
+
+  var::Vector<u32> result;
+  for (size_t i = 0; i < row_count; i++) {
+    if (match[i]) {
+      result.push_back(i);
+    }
+  }
+  return result;
+}
@@ -0,0 +1,293 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#include <cstdio>
+
+#if defined __win32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "usb/EnumerationCache.hpp"
+
+using namespace usb;
+
+EnumerationCache &EnumerationCache::open(const var::StringView path) {
+  close();
+  m_path = var::String(path);
+  map();
+  return *this;
+}
+
+EnumerationCache &EnumerationCache::close() {
+  unmap();
+  m_store_list.clear();
+  m_path = var::String();
+  return *this;
+}
+
+bool EnumerationCache::restore(Device &device) const {
+  Record key;
+  if (is_open() == false || get_key(device, key) == false) {
+    return false;
+  }
+
+  const u8 *entry = find(key);
+  if (entry == nullptr) {
+    return false;
+  }
+
+  const Record record = get_record(entry);
+  var::StringList string_list;
+  const u8 *value = entry + sizeof(Record);
+  const u8 *end = entry + record.size;
+  for (u8 i = 0; i < record.string_count; i++) {
+    if (value + 2 > end || value + 2 + value[1] > end) {
+      return false;
+    }
+    const u8 index = value[0];
+    const u8 length = value[1];
+    if (string_list.count() <= index) {
+      string_list.resize(index + 1);
+    }
+    string_list.at(index)
+      = var::String(reinterpret_cast<const char *>(value + 2), length);
+    value += 2 + length;
+  }
+
+  device.set_string_list(string_list);
+  return true;
+}
+
+EnumerationCache &EnumerationCache::store(const Device &device) {
+  Record key;
+  if (is_open() == false || get_key(device, key) == false) {
+    return *this;
+  }
+
+  const var::StringList &string_list = device.string_list();
+  if (device.is_string_list_loaded() == false) {
+    // a failed or partial read would be restored as the real strings
+    return *this;
+  }
+
+  u32 size = sizeof(Record);
+  key.string_count = 0;
+  for (size_t i = 1; i < string_list.count() && i < 256; i++) {
+    if (string_list.at(i).length() > 0) {
+      const u32 length = string_list.at(i).length();
+      size += 2 + (length > 255 ? 255 : length);
+      key.string_count++;
+    }
+  }
+  if (size > 0xffff) {
+    // doesn't fit the size field, the device is read again next time
+    return *this;
+  }
+  key.size = size;
+
+  var::Data entry(size);
+  memcpy(entry.data(), &key, sizeof(Record));
+  u8 *value = entry.data() + sizeof(Record);
+  for (size_t i = 1; i < string_list.count() && i < 256; i++) {
+    const var::String &string = string_list.at(i);
+    if (string.length() > 0) {
+      const u8 length = string.length() > 255 ? 255 : string.length();
+      value[0] = i;
+      value[1] = length;
+      memcpy(value + 2, string.cstring(), length);
+      value += 2 + length;
+    }
+  }
+
+  for (var::Data &stored : m_store_list) {
+    if (get_record(stored.data()).is_key_equal(key)) {
+      stored = entry;
+      return *this;
+    }
+  }
+  m_store_list.push_back(entry);
+  return *this;
+}
+
+EnumerationCache &EnumerationCache::save() {
+  if (is_open() == false || m_store_list.count() == 0) {
+    return *this;
+  }
+
+  var::Vector<const u8 *> entry_list;
+  for (const var::Data &stored : m_store_list) {
+    entry_list.push_back(stored.data());
+  }
+  for (const u8 *mapped : m_record_list) {
+    const Record record = get_record(mapped);
+    bool is_replaced = false;
+    for (const var::Data &stored : m_store_list) {
+      is_replaced
+        = is_replaced || get_record(stored.data()).is_key_equal(record);
+    }
+    if (is_replaced == false) {
+      entry_list.push_back(mapped);
+    }
+  }
+
+  Header header;
+  header.magic = magic;
+  header.version = version;
+  header.record_count
+    = entry_list.count() > 0xffff ? 0xffff : entry_list.count();
+
+  // readers keep the old file mapped until they reopen it, the process id
+  // keeps processes that save at the same time out of each other's file
+#if defined __win32
+  const int process_id = _getpid();
+#else
+  const int process_id = getpid();
+#endif
+  const var::String temporary_path
+    = var::String(m_path).append(
+      var::NumberString().format(".%d.tmp", process_id));
+  FILE *file = fopen(temporary_path.cstring(), "wb");
+  if (file == nullptr) {
+    return *this;
+  }
+
+  bool is_written = fwrite(&header, sizeof(Header), 1, file) == 1;
+  for (u16 i = 0; i < header.record_count && is_written; i++) {
+    const Record record = get_record(entry_list.at(i));
+    is_written = fwrite(entry_list.at(i), record.size, 1, file) == 1;
+  }
+
+  if (fclose(file) != 0 || is_written == false) {
+    remove(temporary_path.cstring());
+    return *this;
+  }
+
+#if defined __win32
+  // rename() doesn't replace an existing file on windows
+  unmap();
+  remove(m_path.cstring());
+#endif
+  if (rename(temporary_path.cstring(), m_path.cstring()) != 0) {
+    remove(temporary_path.cstring());
+  }
+
+  unmap();
+  m_store_list.clear();
+  map();
+  return *this;
+}
+
+void EnumerationCache::map() {
+#if defined __win32
+  FILE *file = fopen(m_path.cstring(), "rb");
+  if (file == nullptr) {
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (size > 0) {
+    m_map_buffer.resize(size);
+    if (fread(m_map_buffer.data(), size, 1, file) == 1) {
+      m_map = m_map_buffer.data();
+      m_map_size = size;
+    }
+  }
+  fclose(file);
+#else
+  const int fd = ::open(m_path.cstring(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+    void *map
+      = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      m_map = static_cast<const u8 *>(map);
+      m_map_size = file_stat.st_size;
+    }
+  }
+  // the mapping stays valid after the descriptor is closed
+  ::close(fd);
+#endif
+
+  Header header;
+  if (m_map_size < sizeof(Header)) {
+    unmap();
+    return;
+  }
+  memcpy(&header, m_map, sizeof(Header));
+  if (header.magic != magic || header.version != version) {
+    unmap();
+    return;
+  }
+
+  size_t offset = sizeof(Header);
+  for (u16 i = 0; i < header.record_count; i++) {
+    if (offset + sizeof(Record) > m_map_size) {
+      break;
+    }
+    const Record record = get_record(m_map + offset);
+    if (
+      record.size < sizeof(Record) || offset + record.size > m_map_size
+      || record.port_count > port_path_size) {
+      // a truncated or damaged file keeps the records before the damage
+      break;
+    }
+    m_record_list.push_back(m_map + offset);
+    offset += record.size;
+  }
+}
+
+void EnumerationCache::unmap() {
+#if !defined __win32
+  if (m_map != nullptr) {
+    munmap(const_cast<u8 *>(m_map), m_map_size);
+  }
+#endif
+  m_map = nullptr;
+  m_map_size = 0;
+  m_map_buffer = var::Data();
+  m_record_list.clear();
+}
+
+const u8 *EnumerationCache::find(const Record &key) const {
+  for (const var::Data &stored : m_store_list) {
+    if (get_record(stored.data()).is_key_equal(key)) {
+      return stored.data();
+    }
+  }
+  for (const u8 *mapped : m_record_list) {
+    if (get_record(mapped).is_key_equal(key)) {
+      return mapped;
+    }
+  }
+  return nullptr;
+}
+
+bool EnumerationCache::get_key(const Device &device, Record &key) {
+  libusb_device_descriptor descriptor;
+  if (
+    (device.native_device() == nullptr)
+    || (libusb_get_device_descriptor(device.native_device(), &descriptor)
+        < 0)) {
+    return false;
+  }
+
+  memset(&key, 0, sizeof(Record));
+  key.vendor_id = descriptor.idVendor;
+  key.product_id = descriptor.idProduct;
+  key.bcd_device = descriptor.bcdDevice;
+  key.bus_number = libusb_get_bus_number(device.native_device());
+  const int count = libusb_get_port_numbers(
+    device.native_device(),
+    key.port_path,
+    sizeof(key.port_path));
+  key.port_count = count > 0 ? count : 0;
+  return true;
+}
@@ -1,5 +1,13 @@
 // Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
 
+#include <algorithm>
+#include <atomic>
+#include <unordered_set>
+
+#if !defined __win32
+#include <fcntl.h>
+#endif
+
 #include "usb/Session.hpp"
 
 using namespace usb;
@@ -7,10 +15,619 @@ using namespace usb;
 #define LIBUSB_VERBOSE_DEBUG 0
 
 
-Session::Session() {
-  libusb_init(&m_context);
+bool SessionOptions::is_match(libusb_device *device) const {
+  libusb_device_descriptor descriptor;
+  if (libusb_get_device_descriptor(device, &descriptor) < 0) {
+    return false;
+  }
+
+  if (is_match(descriptor) == false) {
+    return false;
+  }
+
+  if (bus_number() && (libusb_get_bus_number(device) != bus_number())) {
+    return false;
+  }
+
+  if (port_path().count()) {
+    u8 port_numbers[7];
+    const int count
+      = libusb_get_port_numbers(device, port_numbers, sizeof(port_numbers));
+    if (count != static_cast<int>(port_path().count())) {
+      return false;
+    }
+    for (int i = 0; i < count; i++) {
+      if (port_numbers[i] != port_path().at(i)) {
+        return false;
+      }
+    }
+  }
+
+  if (interface_class() + interface_sub_class() + interface_protocol() == 0) {
+    return true;
+  }
+
+  for (u8 i = 0; i < descriptor.bNumConfigurations; i++) {
+    libusb_config_descriptor *config = nullptr;
+    if (libusb_get_config_descriptor(device, i, &config) < 0) {
+      continue;
+    }
+
+    bool result = false;
+    for (u8 j = 0; j < config->bNumInterfaces && !result; j++) {
+      const libusb_interface &iface = config->interface[j];
+      for (int k = 0; k < iface.num_altsetting && !result; k++) {
+        result = is_interface_match(iface.altsetting[k]);
+      }
+    }
+    libusb_free_config_descriptor(config);
+
+    if (result) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool SessionOptions::is_interface_match(
+  const libusb_interface_descriptor &descriptor) const {
+  if (
+    interface_class() && (descriptor.bInterfaceClass != interface_class())) {
+    return false;
+  }
+  if (
+    interface_sub_class()
+    && (descriptor.bInterfaceSubClass != interface_sub_class())) {
+    return false;
+  }
+  if (
+    interface_protocol()
+    && (descriptor.bInterfaceProtocol != interface_protocol())) {
+    return false;
+  }
+  return true;
+}
+
+Session::Session(IsDeviceDiscovery is_device_discovery)
+  : m_is_device_discovery(is_device_discovery) {
+  init_context();
+
+#if !defined __linux
+  m_sysfs.set_path("");
+#endif
 
 #if LIBUSB_VERBOSE_DEBUG
   libusb_set_option(m_context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
 #endif
 }
+
+int Session::init_context() {
+  if (m_is_device_discovery == IsDeviceDiscovery::yes) {
+    return libusb_init(&m_context);
+  }
+
+#if LIBUSB_API_VERSION >= 0x0100010A
+  // libusb 1.0.27 takes the option for this context only
+  libusb_init_option option = {};
+  option.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY;
+  return libusb_init_context(&m_context, &option, 1);
+#else
+  // older versions only have the process wide default, it must be set
+  // before libusb_init() and can't be cleared (1.0.25 renamed it
+  // LIBUSB_OPTION_NO_DEVICE_DISCOVERY)
+  libusb_set_option(nullptr, LIBUSB_OPTION_WEAK_AUTHORITY);
+  return libusb_init(&m_context);
+#endif
+}
+
+const DeviceList &Session::get_device_list(const SessionOptions &options) {
+  if (is_error()) {
+    m_device_list.clear();
+    return device_list();
+  }
+
+  // rescan() starts over
+  m_rescan_list.clear();
+
+  if (is_hotplug()) {
+    update_hotplug_cache();
+    var::Vector<libusb_device *> native_list;
+    native_list.reserve(m_hotplug_device_list.count());
+    for (const Device &device : m_hotplug_device_list) {
+      native_list.push_back(device.native_device());
+    }
+    update_summary_table(native_list.data(), native_list.count());
+
+    var::Vector<Device *> match_list;
+    for (u32 row : m_summary_table.find(options.to_summary_query())) {
+      Device &device = m_hotplug_device_list.at(row);
+      if (
+        options.is_summary_match()
+        || options.is_match(device.native_device())) {
+        match_list.push_back(&device);
+      }
+    }
+
+    // strings are loaded into the cache so later lists reuse them
+    update_strings(match_list, options.worker_count());
+    update_device_list(match_list);
+    return device_list();
+  }
+
+  const ssize_t count = load_libusb_device_list();
+  update_summary_table(m_libusb_device_list, count);
+
+  // rejected devices never become Device objects
+  var::Vector<Device *> match_list;
+  for (u32 row : m_summary_table.find(options.to_summary_query())) {
+    libusb_device *device = m_libusb_device_list[row];
+    if (options.is_summary_match() || options.is_match(device)) {
+      match_list.push_back(&get_stored_device(device));
+    }
+  }
+
+  update_strings(match_list, options.worker_count());
+  update_device_list(match_list);
+  return device_list();
+}
+
+Rescan Session::rescan(const SessionOptions &options) {
+  Rescan result;
+  API_RETURN_VALUE_IF_ERROR(result);
+
+  const bool is_first = m_rescan_list.count() == 0;
+
+  // with hotplug running get_device_list() reads the cache, the polled list
+  // could disagree with it until the events have been handled
+  var::Vector<libusb_device *> hotplug_list;
+  libusb_device *const *device_list = nullptr;
+  size_t count = 0;
+  if (is_hotplug()) {
+    update_hotplug_cache();
+    hotplug_list.reserve(m_hotplug_device_list.count());
+    for (const Device &device : m_hotplug_device_list) {
+      hotplug_list.push_back(device.native_device());
+    }
+    device_list = hotplug_list.data();
+    count = hotplug_list.count();
+  } else {
+    count = load_libusb_device_list();
+    device_list = m_libusb_device_list;
+  }
+
+  // only libusb's copy of each device is read here
+  var::Vector<RescanEntry> entry_list;
+  entry_list.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    RescanEntry entry = {};
+    entry.device = device_list[i];
+    entry.location[0] = libusb_get_bus_number(entry.device);
+    libusb_get_port_numbers(entry.device, entry.location + 1, 7);
+    entry.location[8] = libusb_get_device_address(entry.device);
+    entry_list.push_back(entry);
+  }
+  std::sort(entry_list.begin(), entry_list.end());
+
+  var::Vector<const RescanEntry *> removed_list;
+  var::Vector<Device *> added_list;
+  size_t previous = 0;
+  for (RescanEntry &entry : entry_list) {
+    while (previous < m_rescan_list.count()
+           && m_rescan_list.at(previous) < entry) {
+      removed_list.push_back(&m_rescan_list.at(previous++));
+    }
+
+    if (
+      previous < m_rescan_list.count()
+      && (entry < m_rescan_list.at(previous)) == false) {
+      const RescanEntry &unchanged = m_rescan_list.at(previous++);
+      entry.is_match = unchanged.is_match;
+      entry.vendor_id = unchanged.vendor_id;
+      entry.product_id = unchanged.product_id;
+      continue;
+    }
+
+    libusb_device_descriptor descriptor;
+    if (libusb_get_device_descriptor(entry.device, &descriptor) == 0) {
+      entry.vendor_id = descriptor.idVendor;
+      entry.product_id = descriptor.idProduct;
+    }
+    entry.is_match = options.is_match(entry.device);
+    if (entry.is_match) {
+      added_list.push_back(
+        is_hotplug() ? get_hotplug_device(entry.device)
+                     : &get_stored_device(entry.device));
+    }
+  }
+  while (previous < m_rescan_list.count()) {
+    removed_list.push_back(&m_rescan_list.at(previous++));
+  }
+
+  if (is_first) {
+    m_device_list.clear();
+  }
+
+  for (const RescanEntry *entry : removed_list) {
+    if (entry->is_match == false) {
+      continue;
+    }
+
+    // the device may be gone, only its address is compared
+    auto device = m_device_list.begin();
+    while (device != m_device_list.end()
+           && device->native_device() != entry->device) {
+      device++;
+    }
+    if (device != m_device_list.end()) {
+      m_device_list.erase(device);
+    }
+
+    var::Vector<u8> port_path;
+    for (size_t i = 1; i < 8 && entry->location[i] != 0; i++) {
+      port_path.push_back(entry->location[i]);
+    }
+    result.removed_list().push_back(DeviceLocation()
+                                      .set_bus_number(entry->location[0])
+                                      .set_port_path(port_path)
+                                      .set_device_address(entry->location[8])
+                                      .set_vendor_id(entry->vendor_id)
+                                      .set_product_id(entry->product_id));
+  }
+
+  if (added_list.count()) {
+    update_strings(added_list, options.worker_count());
+  }
+  for (const Device *device : added_list) {
+    m_device_list.push_back(*device);
+    result.added_list().push_back(*device);
+  }
+
+  if (is_first || result.is_empty() == false) {
+    m_device_list.mark_changed().update_index();
+  }
+  m_rescan_list = std::move(entry_list);
+  return result;
+}
+
+ssize_t Session::load_libusb_device_list() {
+  // the previous list holds a reference to devices that are still present
+  // until the new one is fetched so their libusb_device doesn't change
+  libusb_device **previous_list = m_libusb_device_list;
+  m_libusb_device_list = nullptr;
+
+  ssize_t count = API_SYSTEM_CALL(
+    "Session::libusb_get_device_list",
+    libusb_get_device_list(m_context, &m_libusb_device_list));
+  if (count < 0) {
+    count = 0;
+  }
+
+  // forget devices that were disconnected
+  std::unordered_set<libusb_device *> present_set(
+    m_libusb_device_list,
+    m_libusb_device_list + count);
+  for (auto entry = m_device_store.begin(); entry != m_device_store.end();) {
+    entry = present_set.count(entry->first) ? std::next(entry)
+                                            : m_device_store.erase(entry);
+  }
+
+  if (previous_list != nullptr) {
+    libusb_free_device_list(previous_list, 1);
+  }
+  return count;
+}
+
+void Session::update_device_list(const var::Vector<Device *> &match_list) {
+  bool is_changed = match_list.count() != m_device_list.count();
+  for (size_t i = 0; i < match_list.count() && is_changed == false; i++) {
+    is_changed = match_list.at(i)->is_same(m_device_list.at(i)) == false;
+  }
+
+  if (is_changed == false) {
+    return;
+  }
+
+  // the copies share descriptors and strings with the stored devices
+  m_device_list.clear();
+  m_device_list.reserve(match_list.count());
+  for (const Device *device : match_list) {
+    m_device_list.push_back(*device);
+  }
+  m_device_list.mark_changed().update_index();
+}
+
+void Session::update_summary_table(
+  libusb_device *const *device_list,
+  size_t count) {
+  // libusb keeps the same libusb_device while a device stays connected so
+  // the rows only change when the bus does
+  bool is_changed = count != m_summary_table.count();
+  for (size_t i = 0; i < count && is_changed == false; i++) {
+    is_changed = m_summary_table.device(i) != device_list[i];
+  }
+
+  if (is_changed == false) {
+    return;
+  }
+
+  m_summary_table.clear().reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    m_summary_table.push_back(device_list[i]);
+  }
+}
+
+Device *Session::get_hotplug_device(libusb_device *device) {
+  // only called for arrivals, a linear search is fine
+  for (Device &cached : m_hotplug_device_list) {
+    if (cached.native_device() == device) {
+      return &cached;
+    }
+  }
+  return nullptr;
+}
+
+Device &Session::get_stored_device(libusb_device *device) {
+  auto entry = m_device_store.find(device);
+  if (entry == m_device_store.end()) {
+    entry = m_device_store.emplace(device, Device(device, m_context)).first;
+  }
+  return entry->second;
+}
+
+DeviceHandle Session::open_device(
+  const var::StringView node_path,
+  int configuration,
+  const var::StringView interface_path) {
+  API_RETURN_VALUE_IF_ERROR(DeviceHandle());
+#if defined __win32
+  MCU_UNUSED_ARGUMENT(node_path);
+  MCU_UNUSED_ARGUMENT(configuration);
+  MCU_UNUSED_ARGUMENT(interface_path);
+  API_SYSTEM_CALL("Session::open_device", int(LIBUSB_ERROR_NOT_SUPPORTED));
+  return DeviceHandle();
+#else
+  const int fd = API_SYSTEM_CALL(
+    "Session::open",
+    ::open(var::PathString(node_path).cstring(), O_RDWR));
+  if (fd < 0) {
+    return DeviceHandle();
+  }
+  return Device::wrap_handle(
+    m_context,
+    fd,
+    configuration,
+    interface_path,
+    true);
+#endif
+}
+
+void Session::update_strings(
+  const var::Vector<Device *> &device_list,
+  u8 worker_count) {
+  // devices kept from an earlier list already have their strings
+  var::Vector<Device *> load_list;
+  for (Device *device : device_list) {
+    if (device->is_string_list_loaded() == false) {
+      load_list.push_back(device);
+    }
+  }
+
+  if (load_list.count() == 0) {
+    return;
+  }
+
+  if (m_sysfs.path().is_empty() == false) {
+    // only the directories of the devices being loaded are read
+    m_sysfs.clear();
+    for (const Device *device : load_list) {
+      m_sysfs.load(Sysfs::get_name(device->native_device()));
+    }
+  }
+
+  var::Vector<Device *> miss_list;
+  for (Device *device : load_list) {
+    if (
+      m_sysfs.restore(*device) == false
+      && m_enumeration_cache.restore(*device) == false) {
+      miss_list.push_back(device);
+    }
+  }
+
+  if (m_enumeration_cache.is_open() == false || miss_list.count() == 0) {
+    load_strings(miss_list, worker_count);
+    return;
+  }
+
+  load_strings(miss_list, worker_count);
+  // store() skips devices whose strings couldn't all be read
+  for (const Device *device : miss_list) {
+    m_enumeration_cache.store(*device);
+  }
+  m_enumeration_cache.save();
+}
+
+void Session::load_strings(
+  const var::Vector<Device *> &device_list,
+  u8 worker_count) {
+  if (worker_count < 2) {
+    return;
+  }
+
+  // each worker claims the next device, the list order never changes
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i = next++; i < device_list.count(); i = next++) {
+      device_list.at(i)->string_list();
+    }
+  };
+
+  const size_t thread_count
+    = worker_count < device_list.count() ? worker_count : device_list.count();
+  var::Vector<std::thread> thread_list;
+  for (size_t i = 1; i < thread_count; i++) {
+    thread_list.push_back(std::thread(work));
+  }
+  work();
+
+  for (std::thread &thread : thread_list) {
+    thread.join();
+  }
+}
+
+Session &Session::start_hotplug(const SessionOptions &options) {
+  API_RETURN_VALUE_IF_ERROR(*this);
+  if (is_hotplug()) {
+    return *this;
+  }
+
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) == 0) {
+    API_SYSTEM_CALL(
+      "Session::libusb_has_capability",
+      int(LIBUSB_ERROR_NOT_SUPPORTED));
+    return *this;
+  }
+
+  m_is_hotplug = true;
+  API_SYSTEM_CALL(
+    "Session::libusb_hotplug_register_callback",
+    libusb_hotplug_register_callback(
+      m_context,
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_ENUMERATE,
+      options.vendor_id() ? options.vendor_id() : LIBUSB_HOTPLUG_MATCH_ANY,
+      options.product_id() ? options.product_id() : LIBUSB_HOTPLUG_MATCH_ANY,
+      options.device_class() ? options.device_class()
+                             : LIBUSB_HOTPLUG_MATCH_ANY,
+      handle_hotplug,
+      this,
+      &m_hotplug_handle));
+
+  if (is_error()) {
+    m_is_hotplug = false;
+  }
+  return *this;
+}
+
+Session &Session::stop_hotplug() {
+  if (is_hotplug() == false) {
+    return *this;
+  }
+
+  libusb_hotplug_deregister_callback(m_context, m_hotplug_handle);
+  m_is_hotplug = false;
+
+  std::lock_guard<std::mutex> lock(m_hotplug_mutex);
+  for (const HotplugEvent &event : m_hotplug_event_list) {
+    libusb_unref_device(event.device);
+  }
+  for (const Device &device : m_hotplug_device_list) {
+    libusb_unref_device(device.native_device());
+  }
+  for (libusb_device *device : m_departed_set) {
+    libusb_unref_device(device);
+  }
+  m_hotplug_event_list.clear();
+  m_hotplug_device_list.clear();
+  m_departed_set.clear();
+  return *this;
+}
+
+bool Session::is_departed(const Device &device) {
+  // safe from any thread, only reads what handle_hotplug() recorded
+  std::lock_guard<std::mutex> lock(m_hotplug_mutex);
+  return m_departed_set.count(device.native_device()) > 0;
+}
+
+void Session::update_hotplug_cache() {
+  if (is_event_thread_running() == false) {
+    // nobody else is dispatching hotplug callbacks
+    struct timeval tv = {0, 0};
+    libusb_handle_events_timeout_completed(m_context, &tv, nullptr);
+  }
+
+  var::Vector<HotplugEvent> event_list;
+  {
+    std::lock_guard<std::mutex> lock(m_hotplug_mutex);
+    std::swap(event_list, m_hotplug_event_list);
+  }
+
+  for (const HotplugEvent &event : event_list) {
+    auto cached = m_hotplug_device_list.begin();
+    while (cached != m_hotplug_device_list.end()
+           && cached->native_device() != event.device) {
+      cached++;
+    }
+
+    if (event.is_arrived && cached == m_hotplug_device_list.end()) {
+      // the cache keeps the reference taken in handle_hotplug()
+      m_hotplug_device_list.push_back(Device(event.device, m_context));
+      continue;
+    }
+
+    if (!event.is_arrived && cached != m_hotplug_device_list.end()) {
+      libusb_unref_device(cached->native_device());
+      m_hotplug_device_list.erase(cached);
+    }
+
+    // ENUMERATE can report an arrival twice and a departure for a device
+    // that never arrived
+    libusb_unref_device(event.device);
+  }
+}
+
+int LIBUSB_CALL Session::handle_hotplug(
+  libusb_context *context,
+  libusb_device *device,
+  libusb_hotplug_event event,
+  void *user_data) {
+  MCU_UNUSED_ARGUMENT(context);
+  Session *self = static_cast<Session *>(user_data);
+  std::lock_guard<std::mutex> lock(self->m_hotplug_mutex);
+  // Device opens the device to read strings, that waits for
+  // update_hotplug_cache() on the caller's thread
+  HotplugEvent hotplug_event;
+  hotplug_event.device = libusb_ref_device(device);
+  hotplug_event.is_arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+  self->m_hotplug_event_list.push_back(hotplug_event);
+  // the set keeps its own reference so libusb can't hand the pointer to
+  // another device while a DeviceHandle may still ask about it
+  if (hotplug_event.is_arrived) {
+    if (self->m_departed_set.erase(device) > 0) {
+      libusb_unref_device(device);
+    }
+  } else if (self->m_departed_set.insert(device).second) {
+    libusb_ref_device(device);
+  }
+  return 0;
+}
+
+Session &Session::start_event_thread() {
+  API_RETURN_VALUE_IF_ERROR(*this);
+  if (is_event_thread_running()) {
+    return *this;
+  }
+  m_is_event_thread_stop = 0;
+  m_event_thread = std::thread(&Session::handle_events, this);
+  return *this;
+}
+
+Session &Session::stop_event_thread() {
+  if (is_event_thread_running() == false) {
+    return *this;
+  }
+  m_is_event_thread_stop = 1;
+  // wakes the thread if it is blocked waiting for events
+  libusb_interrupt_event_handler(m_context);
+  m_event_thread.join();
+  return *this;
+}
+
+void Session::handle_events() {
+  // stop_event_thread() wakes the thread with
+  // libusb_interrupt_event_handler(), libusb doesn't read the flag
+  while (m_is_event_thread_stop == 0) {
+    struct timeval tv = {0, 100000};
+    libusb_handle_events_timeout_completed(m_context, &tv, nullptr);
+  }
+}
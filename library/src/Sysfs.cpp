@@ -0,0 +1,264 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#include <cstdlib>
+
+#if !defined __win32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "usb/Sysfs.hpp"
+
+using namespace usb;
+
+Sysfs &Sysfs::load() {
+  m_entry_list.clear();
+  for (const var::String &name : read_directory()) {
+    // interfaces are listed as <device>:<configuration>.<interface>
+    if (name.string_view().find(":") == var::StringView::npos) {
+      load(name);
+    }
+  }
+  return *this;
+}
+
+Sysfs &Sysfs::load(const var::StringView name) {
+  Entry entry = load_entry(name);
+  if (entry.bus_number() == 0 || entry.device_address() == 0) {
+    return *this;
+  }
+
+  load_interface_strings(
+    entry,
+    read_file(
+      var::String(m_path).append("/").append(name).append("/descriptors")));
+  m_entry_list.push_back(entry);
+  return *this;
+}
+
+const Sysfs::Entry *Sysfs::find(u8 bus_number, u8 device_address) const {
+  for (const Entry &entry : m_entry_list) {
+    if (
+      entry.bus_number() == bus_number
+      && entry.device_address() == device_address) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+bool Sysfs::restore(Device &device) const {
+  if (device.native_device() == nullptr) {
+    return false;
+  }
+
+  const Entry *entry = find(
+    libusb_get_bus_number(device.native_device()),
+    libusb_get_device_address(device.native_device()));
+  if (entry == nullptr) {
+    return false;
+  }
+
+  const var::StringList &string_list = entry->string_list();
+  for (size_t i = 1; i < string_list.count(); i++) {
+    if (string_list.at(i).is_empty() == false) {
+      device.set_string(i, string_list.at(i));
+    }
+  }
+  return device.check_string_list_loaded();
+}
+
+Sysfs::Entry Sysfs::load_entry(const var::StringView name) const {
+  Entry result;
+  result.set_name(var::String(name))
+    .set_bus_number(strtoul(read_attribute(name, "busnum").cstring(), 0, 10))
+    .set_device_address(
+      strtoul(read_attribute(name, "devnum").cstring(), 0, 10))
+    .set_port_path(get_port_path(name))
+    .set_vendor_id(strtoul(read_attribute(name, "idVendor").cstring(), 0, 16))
+    .set_product_id(
+      strtoul(read_attribute(name, "idProduct").cstring(), 0, 16))
+    .set_bcd_device(
+      strtoul(read_attribute(name, "bcdDevice").cstring(), 0, 16));
+  return result;
+}
+
+void Sysfs::load_interface_strings(
+  Entry &entry,
+  const var::Data &descriptors) const {
+  const u8 *data = descriptors.data();
+  const size_t size = descriptors.size();
+  if (size < LIBUSB_DT_DEVICE_SIZE || data[1] != LIBUSB_DT_DEVICE) {
+    // without the descriptors the strings can't be matched to indices
+    return;
+  }
+
+  var::StringList string_list;
+  auto set_string = [&](u8 index, const var::String &value) {
+    if (index == 0 || value.is_empty()) {
+      return;
+    }
+    if (string_list.count() <= index) {
+      string_list.resize(index + 1);
+    }
+    string_list.at(index) = value;
+  };
+
+  const var::StringView name = entry.name().string_view();
+  set_string(data[14], read_attribute(name, "manufacturer"));
+  set_string(data[15], read_attribute(name, "product"));
+  set_string(data[16], read_attribute(name, "serial"));
+
+  // sysfs only has strings for the active configuration
+  const u8 configuration_value
+    = strtoul(read_attribute(name, "bConfigurationValue").cstring(), 0, 10);
+
+
+  u8 current_configuration = 0;
+  for (size_t offset = LIBUSB_DT_DEVICE_SIZE; offset + 2 <= size;) {
+    const u8 length = data[offset];
+    const u8 type = data[offset + 1];
+    if (length < 2 || offset + length > size) {
+      break;
+    }
+
+    if (type == LIBUSB_DT_CONFIG && length >= LIBUSB_DT_CONFIG_SIZE) {
+      current_configuration = data[offset + 5];
+      if (current_configuration == configuration_value) {
+        set_string(data[offset + 6], read_attribute(name, "configuration"));
+      }
+    } else if (
+      type == LIBUSB_DT_INTERFACE && length >= LIBUSB_DT_INTERFACE_SIZE
+      && current_configuration == configuration_value) {
+      // the kernel names interfaces <device>:<configuration>.<interface>
+      // so the directory is known without listing the others
+      const var::String interface_name
+        = var::String(name).append(var::NumberString().format(
+          ":%d.%d",
+          configuration_value,
+          data[offset + 2]));
+
+      // the interface directory describes the current alternate setting
+      if (
+        strtoul(
+          read_attribute(interface_name, "bAlternateSetting").cstring(),
+          0,
+          10)
+        == data[offset + 3]) {
+        set_string(
+          data[offset + 8],
+          read_attribute(interface_name, "interface"));
+      }
+    }
+    offset += length;
+  }
+
+  entry.set_string_list(string_list);
+}
+
+var::String Sysfs::read_attribute(
+  const var::StringView name,
+  const var::StringView attribute) const {
+  const var::Data data = read_file(
+    var::String(m_path).append("/").append(name).append("/").append(
+      attribute));
+
+  // attributes end with a newline and some numbers are padded with spaces
+  const char *value = reinterpret_cast<const char *>(data.data());
+  size_t start = 0;
+  size_t end = data.size();
+  while (start < end && (value[start] == ' ' || value[start] == '\t')) {
+    start++;
+  }
+  while (end > start
+         && (value[end - 1] == '\n' || value[end - 1] == ' '
+             || value[end - 1] == '\r' || value[end - 1] == 0)) {
+    end--;
+  }
+  return var::String(value + start, end - start);
+}
+
+var::Data Sysfs::read_file(const var::String &path) const {
+  var::Data result;
+#if !defined __win32
+  const int fd = ::open(path.cstring(), O_RDONLY);
+  if (fd < 0) {
+    return result;
+  }
+
+  // sysfs reports a size of 4096 for every attribute so read until the end
+  u8 buffer[512];
+  int bytes_read;
+  while ((bytes_read = ::read(fd, buffer, sizeof(buffer))) > 0) {
+    const size_t offset = result.size();
+    result.resize(offset + bytes_read);
+    memcpy(result.data() + offset, buffer, bytes_read);
+  }
+  ::close(fd);
+#else
+  MCU_UNUSED_ARGUMENT(path);
+#endif
+  return result;
+}
+
+var::StringList Sysfs::read_directory() const {
+  var::StringList result;
+#if !defined __win32
+  DIR *directory = opendir(m_path.cstring());
+  if (directory == nullptr) {
+    return result;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != nullptr) {
+    if (entry->d_name[0] != '.') {
+      result.push_back(var::String(entry->d_name));
+    }
+  }
+  closedir(directory);
+#endif
+  return result;
+}
+
+var::String Sysfs::get_name(libusb_device *device) {
+  const u8 bus_number = libusb_get_bus_number(device);
+  u8 port_path[7];
+  const int count
+    = libusb_get_port_numbers(device, port_path, sizeof(port_path));
+  if (count <= 0) {
+    return var::String("usb").append(
+      var::NumberString().format("%d", bus_number));
+  }
+
+  var::String result = var::String().append(
+    var::NumberString().format("%d-%d", bus_number, port_path[0]));
+  for (int i = 1; i < count; i++) {
+    result.append(var::NumberString().format(".%d", port_path[i]));
+  }
+  return result;
+}
+
+var::Vector<u8> Sysfs::get_port_path(const var::StringView name) {
+  // <bus>-<port>.<port>..., root hubs are usb<bus> and have no ports
+  var::Vector<u8> result;
+  const size_t dash = name.find("-");
+  if (dash == var::StringView::npos) {
+    return result;
+  }
+
+  u32 port = 0;
+  for (size_t i = dash + 1; i < name.length(); i++) {
+    const char c = name.at(i);
+    if (c == '.') {
+      result.push_back(port);
+      port = 0;
+    } else if (c >= '0' && c <= '9') {
+      port = port * 10 + (c - '0');
+    } else {
+      return var::Vector<u8>();
+    }
+  }
+  result.push_back(port);
+  return result;
+}
@@ -0,0 +1,406 @@
+// Copyright 2020-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#include <chrono/ClockTimer.hpp>
+
+#include "usb/Transfer.hpp"
+
+using namespace usb;
+
+Transfer::Transfer(const Construct &options) {
+  m_context = options.context();
+  m_handle = options.handle();
+  m_address = options.address();
+  m_transfer_type = options.transfer_type();
+  m_timeout = options.timeout();
+  m_callback = options.callback();
+  m_callback_context = options.callback_context();
+  m_transfer = libusb_alloc_transfer(0);
+  m_data.resize(options.size());
+}
+
+Transfer::~Transfer() {
+  if (m_transfer == nullptr) {
+    return;
+  }
+
+  // libusb always calls back a cancelled transfer and the callback points
+  // at this object, so it has to run before the transfer is freed
+  while (m_is_callback_done == 0) {
+    cancel();
+    wait(m_context, &m_is_callback_done, chrono::MicroTime(0));
+  }
+  libusb_free_transfer(m_transfer);
+}
+
+int Transfer::submit(int length) {
+  if (m_transfer == nullptr) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  if (is_pending()) {
+    return LIBUSB_ERROR_BUSY;
+  }
+
+  switch (m_transfer_type) {
+  case TransferType::bulk:
+    libusb_fill_bulk_transfer(
+      m_transfer,
+      m_handle,
+      m_address,
+      m_data.data(),
+      length,
+      handle_transfer_complete,
+      this,
+      m_timeout.milliseconds());
+    break;
+  case TransferType::interrupt:
+    libusb_fill_interrupt_transfer(
+      m_transfer,
+      m_handle,
+      m_address,
+      m_data.data(),
+      length,
+      handle_transfer_complete,
+      this,
+      m_timeout.milliseconds());
+    break;
+  default:
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+
+  m_is_complete = 0;
+  m_is_callback_done = 0;
+  const int result = libusb_submit_transfer(m_transfer);
+  if (result < 0) {
+    m_is_complete = 1;
+    m_is_callback_done = 1;
+  }
+  return result;
+}
+
+int Transfer::cancel() {
+  if (is_pending() == false) {
+    return 0;
+  }
+  return libusb_cancel_transfer(m_transfer);
+}
+
+int Transfer::wait(
+  libusb_context *context,
+  int *is_complete,
+  const chrono::MicroTime &timeout) {
+  chrono::ClockTimer timer;
+  timer.start();
+  while (*is_complete == 0) {
+    // zero means wait forever like the synchronous libusb calls
+    u64 wait_microseconds = 100000;
+    if (timeout.microseconds() > 0) {
+      const u64 elapsed = timer.micro_time().microseconds();
+      if (elapsed >= timeout.microseconds()) {
+        return LIBUSB_ERROR_TIMEOUT;
+      }
+      if (timeout.microseconds() - elapsed < wait_microseconds) {
+        wait_microseconds = timeout.microseconds() - elapsed;
+      }
+    }
+
+    struct timeval tv;
+    tv.tv_sec = wait_microseconds / 1000000;
+    tv.tv_usec = wait_microseconds % 1000000;
+    const int result
+      = libusb_handle_events_timeout_completed(context, &tv, is_complete);
+    if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+int Transfer::get_error(const libusb_transfer *transfer) {
+  if (transfer == nullptr) {
+    return LIBUSB_ERROR_IO;
+  }
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return 0;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return LIBUSB_ERROR_INTERRUPTED;
+  case LIBUSB_TRANSFER_STALL:
+    return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return LIBUSB_ERROR_OVERFLOW;
+  default:
+    return LIBUSB_ERROR_IO;
+  }
+}
+
+void LIBUSB_CALL
+Transfer::handle_transfer_complete(libusb_transfer *transfer) {
+  Transfer *self = static_cast<Transfer *>(transfer->user_data);
+  self->m_is_complete = 1;
+  if (self->m_callback != nullptr) {
+    self->m_callback(self->m_callback_context, self);
+  }
+  // still running if the callback submitted it again
+  self->m_is_callback_done = self->m_is_complete;
+}
+
+TransferQueue::TransferQueue(const Construct &options) {
+  m_context = options.context();
+  m_handle = options.handle();
+  m_address = options.address();
+  m_max_packet_size
+    = options.max_packet_size() ? options.max_packet_size() : 64;
+
+  // whole packets only -- an IN transfer can then never overflow
+  u32 transfer_size = options.transfer_size() > m_max_packet_size
+                        ? options.transfer_size() + m_max_packet_size - 1
+                        : m_max_packet_size;
+  transfer_size -= transfer_size % m_max_packet_size;
+
+  m_slot_list.resize(options.depth());
+  for (Slot &slot : m_slot_list) {
+    slot.transfer = libusb_alloc_transfer(0);
+    if (slot.transfer == nullptr) {
+      for (Slot &allocated : m_slot_list) {
+        if (allocated.transfer != nullptr) {
+          libusb_free_transfer(allocated.transfer);
+        }
+      }
+      m_slot_list.clear();
+      return;
+    }
+    slot.buffer.resize(transfer_size);
+  }
+
+  if (is_direction_in()) {
+    prime();
+  }
+}
+
+TransferQueue::~TransferQueue() {
+  cancel();
+  for (Slot &slot : m_slot_list) {
+    if (slot.transfer != nullptr) {
+      libusb_free_transfer(slot.transfer);
+    }
+  }
+}
+
+int TransferQueue::read(
+  void *buf,
+  int nbyte,
+  const chrono::MicroTime &timeout) {
+  u8 *destination = static_cast<u8 *>(buf);
+  int bytes_read = 0;
+
+  while (bytes_read < nbyte) {
+    if (m_pending_count == 0) {
+      const int result = prime();
+      if (m_pending_count == 0) {
+        return bytes_read > 0 ? bytes_read : result;
+      }
+    }
+
+    Slot &slot = head();
+    if (slot.is_complete == 0) {
+      const int result = wait(slot, timeout);
+      if (result < 0) {
+        return bytes_read > 0 ? bytes_read : result;
+      }
+    }
+
+    const int actual_length = slot.transfer->actual_length;
+    const int available = actual_length - slot.offset;
+    const int page_size
+      = available < nbyte - bytes_read ? available : nbyte - bytes_read;
+    if (page_size > 0) {
+      memcpy(
+        destination + bytes_read,
+        slot.buffer.data() + slot.offset,
+        page_size);
+      slot.offset += page_size;
+      bytes_read += page_size;
+    }
+
+    if (slot.offset == actual_length) {
+      // hand the transfer back to the controller right away
+      const int error = release();
+      prime();
+      if (actual_length == 0) {
+        // a zero length packet ends the read like it does for
+        // libusb_bulk_transfer()
+        return bytes_read > 0 ? bytes_read : error;
+      }
+    }
+  }
+
+  return bytes_read;
+}
+
+int TransferQueue::write(
+  const void *buf,
+  int nbyte,
+  const chrono::MicroTime &timeout) {
+  poll();
+  if (m_error < 0) {
+    const int result = m_error;
+    m_error = 0;
+    return result;
+  }
+
+  const u8 *source = static_cast<const u8 *>(buf);
+  const int slot_size = m_slot_list.at(0).buffer.size();
+  int bytes_written = 0;
+
+  do {
+    const int page_size
+      = nbyte - bytes_written > slot_size ? slot_size : nbyte - bytes_written;
+    const int result = queue(source + bytes_written, page_size, timeout);
+    if (result < 0) {
+      return bytes_written > 0 ? bytes_written : result;
+    }
+    bytes_written += page_size;
+  } while (bytes_written < nbyte);
+
+  if (nbyte > 0 && (nbyte % m_max_packet_size) == 0) {
+    queue(nullptr, 0, timeout);
+  }
+
+  return bytes_written;
+}
+
+int TransferQueue::flush(const chrono::MicroTime &timeout) {
+  if (is_direction_in()) {
+    return 0;
+  }
+
+  while (m_pending_count > 0) {
+    const int result = wait(head(), timeout);
+    if (result < 0) {
+      return result;
+    }
+    const int error = release();
+    if (error < 0 && m_error == 0) {
+      m_error = error;
+    }
+  }
+
+  const int result = m_error;
+  m_error = 0;
+  return result;
+}
+
+int TransferQueue::prime() {
+  while (m_pending_count < m_slot_list.count()) {
+    Slot &slot = tail();
+    // IN transfers stay pending until data arrives, read() applies the timeout
+    const int result = submit(slot, slot.buffer.size(), chrono::MicroTime(0));
+    if (result < 0) {
+      return result;
+    }
+    m_pending_count++;
+  }
+  return 0;
+}
+
+int TransferQueue::release() {
+  const int result = Transfer::get_error(head().transfer);
+  m_head = (m_head + 1) % m_slot_list.count();
+  m_pending_count--;
+  return result;
+}
+
+int TransferQueue::submit(
+  Slot &slot,
+  int length,
+  const chrono::MicroTime &timeout) {
+  libusb_fill_bulk_transfer(
+    slot.transfer,
+    m_handle,
+    m_address,
+    slot.buffer.data(),
+    length,
+    handle_transfer_complete,
+    &slot,
+    timeout.milliseconds());
+
+  slot.offset = 0;
+  slot.is_complete = 0;
+  const int result = libusb_submit_transfer(slot.transfer);
+  if (result < 0) {
+    slot.is_complete = 1;
+  }
+  return result;
+}
+
+int TransferQueue::queue(
+  const u8 *data,
+  int size,
+  const chrono::MicroTime &timeout) {
+  if (m_pending_count == m_slot_list.count()) {
+    const int result = wait(head(), timeout);
+    if (result < 0) {
+      return result;
+    }
+    const int error = release();
+    if (error < 0 && m_error == 0) {
+      m_error = error;
+    }
+  }
+
+  Slot &slot = tail();
+  if (size > 0) {
+    memcpy(slot.buffer.data(), data, size);
+  }
+
+  const int result = submit(slot, size, timeout);
+  if (result < 0) {
+    return result;
+  }
+  m_pending_count++;
+  return 0;
+}
+
+int TransferQueue::poll() {
+  struct timeval tv = {0, 0};
+  const int result
+    = libusb_handle_events_timeout_completed(m_context, &tv, nullptr);
+
+  while (m_pending_count > 0 && head().is_complete) {
+    const int error = release();
+    if (error < 0 && m_error == 0) {
+      m_error = error;
+    }
+  }
+  return result;
+}
+
+void TransferQueue::cancel() {
+  for (u8 i = 0; i < m_pending_count; i++) {
+    Slot &slot = m_slot_list.at((m_head + i) % m_slot_list.count());
+    if (slot.is_complete == 0) {
+      libusb_cancel_transfer(slot.transfer);
+    }
+  }
+
+  // libusb owns a cancelled transfer until its callback has run and the
+  // callback writes to the slot, it always runs so keep waiting
+  while (m_pending_count > 0) {
+    while (head().is_complete == 0) {
+      wait(head(), chrono::MicroTime(0));
+    }
+    release();
+  }
+}
+
+void LIBUSB_CALL
+TransferQueue::handle_transfer_complete(libusb_transfer *transfer) {
+  Slot *slot = static_cast<Slot *>(transfer->user_data);
+  slot->is_complete = 1;
+}
@@ -3,6 +3,8 @@
 #include "UsbLinkTransportDriver.hpp"
 
 usb::Session UsbLinkTransportDriver::m_session;
+var::Vector<var::PathString> UsbLinkTransportDriver::m_path_list;
+size_t UsbLinkTransportDriver::m_path_cursor = 0;
 
 UsbLinkTransportDriver::UsbLinkTransportDriver() : m_device_handle() {}
 
@@ -11,6 +13,22 @@ int UsbLinkTransportDriver::initialize(
 
   m_options = options;
 
+  if (options.is_node() || options.is_fd()) {
+    // the caller already knows the device, skip enumeration entirely
+    m_device_handle
+      = options.is_node()
+          ? session().open_device(
+            options.node_path().string_view(),
+            1,
+            options.interface_path())
+          : session().wrap_device(options.fd(), 1, options.interface_path());
+    if (m_device_handle.is_valid() == false) {
+      return -1;
+    }
+    m_device_handle.set_timeout(options.timeout());
+    return 0;
+  }
+
   usb::Device *device
     = session().device_list()(usb::DeviceList::Find()
                                 .set_vendor_id(options.vendor_id())
@@ -51,11 +69,70 @@ int UsbLinkTransportDriver::finalize() {
 }
 
 int UsbLinkTransportDriver::get_status() {
+  // nothing here talks to the device, a transfer that found it gone or a
+  // hotplug departure is enough
+  if (
+    (m_device_handle.is_valid() == false)
+    || m_device_handle.is_disconnected()) {
+    return -1;
+  }
 
-  // is device still available?
+  const usb::Device *device = m_device_handle.device();
+  if ((device != nullptr) && session().is_departed(*device)) {
+    return -1;
+  }
   return 0;
 }
 
+const var::Vector<var::PathString> &UsbLinkTransportDriver::load_path_list() {
+  m_path_list.clear();
+  session().get_device_list(usb::SessionOptions().set_vendor_id(0x20a0));
+  API_RETURN_VALUE_IF_ERROR(m_path_list);
+
+  for (const usb::Device &device : session().device_list()) {
+    // do any of the descriptors contain StratifyOS
+    if (is_device_stratify_os(device) == false) {
+      continue;
+    }
+
+    // check the interfaces
+    usb::ConfigurationDescriptor first_configuration
+      = device.get_configuration_descriptor(0);
+    API_RETURN_VALUE_IF_ERROR(m_path_list);
+
+    for (const usb::Interface iface : first_configuration.interfaces()) {
+      for (const usb::InterfaceDescriptor iface_descriptor :
+           iface.alternate_settings()) {
+        if (is_interface_stratify_os(iface_descriptor) == false) {
+          continue;
+        }
+
+        // check if this interface has a bulk in and bulk out endpoint
+        bool is_bulk_input = false;
+        bool is_bulk_output = false;
+        for (const usb::EndpointDescriptor ep : iface_descriptor.endpoints()) {
+          if (
+            ep.transfer_type() == usb::EndpointDescriptor::TransferType::bulk) {
+            if (ep.is_direction_in()) {
+              is_bulk_input = true;
+            } else {
+              is_bulk_output = true;
+            }
+          }
+        }
+
+        if (is_bulk_input && is_bulk_output) {
+          m_path_list.push_back(
+            UsbLinkPath(device, iface_descriptor.interface_number())
+              .build_path());
+        }
+      }
+    }
+  }
+
+  return m_path_list;
+}
+
 usb::Device *UsbLinkTransportDriver::reload_list_and_find_device(
   const UsbLinkTransportDriverOptions &options) {
   // try re-loading the list if nothing was found
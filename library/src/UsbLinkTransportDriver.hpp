@@ -51,6 +51,40 @@ public:
       }
     }
 
+    // /usb/node/BBB/DDD/IFACE opens /dev/bus/usb/BBB/DDD and
+    // /usb/fileno/N/IFACE wraps an inherited descriptor, neither enumerates
+    // the bus. The keywords aren't hex so they can't be mistaken for a VID.
+    if (list.count() > 2 && list.at(2) == "node") {
+      if (
+        list.count() < 5 || !is_decimal(list.at(3))
+        || !is_decimal(list.at(4))) {
+        m_is_usb_path = false;
+        return;
+      }
+      m_node_path = var::PathString("/dev/bus/usb/")
+                      .append(list.at(3))
+                      .append("/")
+                      .append(list.at(4));
+      if (list.count() > 5) {
+        m_interface_path = list.at(5);
+      }
+      m_is_usb_path = true;
+      return;
+    }
+
+    if (list.count() > 2 && list.at(2) == "fileno") {
+      if (list.count() < 4 || !is_decimal(list.at(3))) {
+        m_is_usb_path = false;
+        return;
+      }
+      m_fd = list.at(3).to_integer();
+      if (list.count() > 4) {
+        m_interface_path = list.at(4);
+      }
+      m_is_usb_path = true;
+      return;
+    }
+
     if (list.count() > 2) {
       m_vendor_id = list.at(2);
     }
@@ -72,6 +106,12 @@ public:
 
   bool is_valid() const { return m_is_usb_path; }
 
+  bool is_node() const { return m_node_path.is_empty() == false; }
+  const var::PathString &node_path() const { return m_node_path; }
+
+  bool is_fd() const { return m_fd >= 0; }
+  int fd() const { return m_fd; }
+
   u16 vendor_id() const {
     return m_vendor_id.to_unsigned_long(var::StringView::Base::hexadecimal);
   }
@@ -93,10 +133,25 @@ public:
 
 private:
   bool m_is_usb_path;
+
+  static bool is_decimal(const var::StringView value) {
+    if (value.length() == 0) {
+      return false;
+    }
+    for (size_t i = 0; i < value.length(); i++) {
+      if (value.at(i) < '0' || value.at(i) > '9') {
+        return false;
+      }
+    }
+    return true;
+  }
+
   var::StringView m_interface_path;
   var::StringView m_vendor_id;
   var::StringView m_product_id;
   var::StringView m_serial_number;
+  var::PathString m_node_path;
+  int m_fd = -1;
 };
 
 class UsbLinkTransportDriver {
@@ -109,44 +164,42 @@ public:
   int get_status();
 
   static bool is_device_stratify_os(const usb::Device &device) {
-
-    for (const auto &entry : device.string_list()) {
-      if (
-        var::String(entry).to_lower().string_view().find("stratify")
-        != var::String::npos) {
-        return true;
-      }
-    }
-
-    // if there are no strings -- check the interface
-    return true;
+    return device.is_stratify_os();
   }
 
   static bool is_interface_stratify_os(
     const usb::InterfaceDescriptor &interface_descriptor) {
-    if (
-      (interface_descriptor.interface_class() == 0xff)
-      && (interface_descriptor.interface_sub_class() == 0x50)
-      && (interface_descriptor.interface_protocol() == 0x51)) {
-      return true;
-    }
-
-    return var::String(interface_descriptor.interface_string())
-             .to_lower()
-             .string_view()
-             .find("stratify")
-           != var::String::npos;
+    return usb::Device::is_stratify_os(interface_descriptor);
   }
 
   static usb::Session &session() { return m_session; }
 
+  // lists the link path of every StratifyOS interface with a bulk pipe
+  static const var::Vector<var::PathString> &load_path_list();
+  static const var::Vector<var::PathString> &path_list() {
+    return m_path_list;
+  }
+  // index of the next path usb_link_transport_getname() returns
+  static size_t &path_cursor() { return m_path_cursor; }
+
   const usb::DeviceHandle &device_handle() const { return m_device_handle; }
   usb::DeviceHandle &device_handle() { return m_device_handle; }
 
 private:
-  API_ACCESS_FUNDAMENTAL(UsbLinkTransportDriver, u8, endpoint_address, 0xff);
+  API_ACCESS_FUNDAMENTAL(
+    UsbLinkTransportDriver,
+    u8,
+    read_endpoint_address,
+    0xff);
+  API_ACCESS_FUNDAMENTAL(
+    UsbLinkTransportDriver,
+    u8,
+    write_endpoint_address,
+    0xff);
   usb::DeviceHandle m_device_handle;
   static usb::Session m_session;
+  static var::Vector<var::PathString> m_path_list;
+  static size_t m_path_cursor;
   UsbLinkTransportDriverOptions m_options;
 
   usb::Device *
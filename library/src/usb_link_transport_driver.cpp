@@ -33,88 +33,53 @@ void usb_link_transport_load_driver(link_transport_mdriver_t *driver) {
 }
 
 int usb_link_transport_getname(char *dest, const char *last, int len) {
-  PathString last_entry;
-  PathString dest_entry;
-
   API_ASSERT(dest != nullptr);
 
-  if (last != nullptr) {
-    last_entry = StringView(last);
-  }
-
-  const usb::SessionOptions session_options
-    = usb::SessionOptions().set_vendor_id(0x20a0);
-
-  // return the format vid/pid/serial
+  const Vector<PathString> &path_list
+    = UsbLinkTransportDriver::path_list();
 
+  // the list is rescanned at the start of each walk, later calls continue
+  // from where the previous one stopped
+  size_t &cursor = UsbLinkTransportDriver::path_cursor();
   if ((last == nullptr) || (last[0] == 0)) {
-    UsbLinkTransportDriver::session().get_device_list(session_options);
+    UsbLinkTransportDriver::load_path_list();
+    cursor = 0;
+  } else if (
+    (cursor == 0) || (cursor > path_list.count())
+    || (path_list.at(cursor - 1).string_view() != StringView(last))) {
+    // someone else walked the list, find `last` the slow way
+    cursor = 0;
+    while (cursor < path_list.count()
+           && path_list.at(cursor).string_view() != StringView(last)) {
+      cursor++;
+    }
+    if (cursor == path_list.count()) {
+      return -1;
+    }
+    cursor++;
   }
 
-  // where is the last entry
-  bool is_next_new = false;
-  for (const usb::Device &device :
-       UsbLinkTransportDriver::session().device_list()) {
-    // do any of the descriptors contain StratifyOS
-    if (UsbLinkTransportDriver::is_device_stratify_os(device)) {
-
-      // check the interfaces
-      usb::ConfigurationDescriptor first_configuration
-        = device.get_configuration_descriptor(0);
-      API_RETURN_VALUE_IF_ERROR(-1);
-
-      usb::InterfaceList interface_list = first_configuration.interface_list();
-      for (const usb::Interface &iface : interface_list) {
-        usb::InterfaceDescriptorList alternate_setting_list
-          = iface.alternate_settings_list();
-        for (const usb::InterfaceDescriptor &iface_descriptor :
-             alternate_setting_list) {
-
-          if (
-            UsbLinkTransportDriver::is_interface_stratify_os(iface_descriptor)
-            == true) {
-            PathString device_path
-              = UsbLinkPath(device, iface_descriptor.interface_number())
-                  .build_path();
-
-            // check if this interface has a bulk in and bulk out endpoint
-            usb::EndpointDescriptorList endpoint_list
-              = iface_descriptor.endpoint_list();
-
-            bool is_bulk_input = false;
-            bool is_bulk_output = false;
-
-            for (const usb::EndpointDescriptor &ep : endpoint_list) {
-              if (
-                ep.transfer_type()
-                == usb::EndpointDescriptor::TransferType::bulk) {
-                if (ep.is_direction_in()) {
-                  is_bulk_input = true;
-                } else {
-                  is_bulk_output = true;
-                }
-              }
-            }
-
-            if (is_bulk_input && is_bulk_output) {
-              if (is_next_new || last_entry.is_empty()) {
-                dest_entry = device_path;
-                View(dest, len).fill(0).copy(View(dest_entry.string_view()));
-                //strncpy(dest, dest_entry.cstring(), static_cast<size_t>(len));
-                return 0;
-              }
-
-              if (device_path == last_entry) {
-                is_next_new = true;
-              }
-            }
-          }
-        }
-      }
-    }
+  if (cursor >= path_list.count()) {
+    return -1;
   }
 
-  return -1;
+  View(dest, len).fill(0).copy(View(path_list.at(cursor).string_view()));
+  cursor++;
+  return 0;
+}
+
+int usb_link_transport_get_path_list(char *dest, int path_max, int count) {
+  API_ASSERT(dest != nullptr || count == 0);
+
+  const Vector<PathString> &path_list
+    = UsbLinkTransportDriver::load_path_list();
+  for (int i = 0; i < count && i < static_cast<int>(path_list.count()); i++) {
+    View(dest + i * path_max, path_max)
+      .fill(0)
+      .copy(View(path_list.at(i).string_view()));
+  }
+  UsbLinkTransportDriver::path_cursor() = 0;
+  return path_list.count();
 }
 
 int usb_link_transport_lock(link_transport_phy_t handle) {
@@ -153,14 +118,23 @@ usb_link_transport_driver_open(const char *path, const void *options) {
     return LINK_PHY_OPEN_ERROR;
   }
 
+  // the first bulk IN and bulk OUT endpoints make up the pipe
   for (const usb::Endpoint &ep : handle->device_handle().endpoint_list()) {
     if (ep.transfer_type() == usb::EndpointDescriptor::TransferType::bulk) {
-      handle->set_endpoint_address(ep.address() & 0x7f);
+      if (ep.is_direction_in()) {
+        if (handle->read_endpoint_address() == 0xff) {
+          handle->set_read_endpoint_address(ep.endpoint_address());
+        }
+      } else if (handle->write_endpoint_address() == 0xff) {
+        handle->set_write_endpoint_address(ep.endpoint_address());
+      }
     }
   }
 
   API_RESET_ERROR();
-  handle->device_handle().seek(handle->endpoint_address());
+  handle->device_handle().set_pipe(
+    handle->read_endpoint_address(),
+    handle->write_endpoint_address());
 
   return handle;
 }
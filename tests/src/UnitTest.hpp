@@ -10,6 +10,7 @@
 #include <test/Test.hpp>
 
 #include "usb.hpp"
+#include "usb/Sysfs.hpp"
 
 class UnitTest : public test::Test {
 public:
@@ -20,11 +21,112 @@ public:
 
 		usb::Session session;
 
+		TEST_ASSERT(sysfs_api_case());
+		TEST_ASSERT(stratify_os_api_case());
 
+		return true;
+
+	}
 
+	bool stratify_os_api_case() {
+		TEST_ASSERT(usb::Device::contains_ignore_case("StratifyOS Link", "stratify"));
+		TEST_ASSERT(usb::Device::contains_ignore_case("Link STRATIFY", "stratify"));
+		TEST_ASSERT(usb::Device::contains_ignore_case("Strat", "stratify") == false);
+		TEST_ASSERT(usb::Device::contains_ignore_case("", "stratify") == false);
 		return true;
+	}
+
+	bool sysfs_api_case() {
+		// a copy of what linux lists for one device with one interface
+		const var::StringView root = "usb-sysfs-test";
+		const var::StringView device = "usb-sysfs-test/1-1.2";
+		const var::StringView interface = "usb-sysfs-test/1-1.2:1.1";
+		remove_sysfs_tree(root);
+		fs::FileSystem()
+			.create_directory(root)
+			.create_directory(device)
+			.create_directory(interface);
+
+		write_attribute(device, "busnum", "1\n");
+		write_attribute(device, "devnum", "5\n");
+		write_attribute(device, "idVendor", "20a0\n");
+		write_attribute(device, "idProduct", "41d5\n");
+		write_attribute(device, "bcdDevice", "0100\n");
+		write_attribute(device, "manufacturer", "Stratify Labs, Inc\n");
+		write_attribute(device, "product", "StratifyOS\n");
+		write_attribute(device, "serial", "0123456789\n");
+		write_attribute(device, "bConfigurationValue", "1\n");
+		write_attribute(device, "configuration", "Default\n");
+		write_attribute(interface, "bInterfaceNumber", "01\n");
+		write_attribute(interface, "bAlternateSetting", " 0\n");
+		write_attribute(interface, "interface", "StratifyOS Link\n");
+
+		const u8 descriptors[] = {
+			// device: iManufacturer 1, iProduct 2, iSerialNumber 3
+			18, 1, 0x00, 0x02, 0, 0, 0, 64, 0xa0, 0x20, 0xd5, 0x41, 0x00, 0x01,
+			1, 2, 3, 1,
+			// configuration 1: iConfiguration 4
+			9, 2, 27, 0, 2, 1, 4, 0xc0, 50,
+			// interface 0 has no string
+			9, 4, 0, 0, 0, 0xff, 0, 0, 0,
+			// interface 1: iInterface 5
+			9, 4, 1, 0, 2, 0xff, 0xff, 0xff, 5};
+		fs::File(
+			fs::File::IsOverwrite::yes,
+			var::PathString(device).append("/descriptors"))
+			.write(var::View(descriptors, sizeof(descriptors)));
+
+		usb::Sysfs sysfs(root);
+		sysfs.load();
+		TEST_ASSERT(sysfs.entry_list().count() == 1);
 
+		const usb::Sysfs::Entry *entry = sysfs.find(1, 5);
+		TEST_ASSERT(entry != nullptr);
+		TEST_ASSERT(entry->vendor_id() == 0x20a0);
+		TEST_ASSERT(entry->product_id() == 0x41d5);
+		TEST_ASSERT(entry->bcd_device() == 0x0100);
+		TEST_ASSERT(entry->port_path().count() == 2);
+		TEST_ASSERT(entry->port_path().at(0) == 1);
+		TEST_ASSERT(entry->port_path().at(1) == 2);
+
+		const var::StringList &string_list = entry->string_list();
+		TEST_ASSERT(string_list.count() == 6);
+		TEST_ASSERT(string_list.at(1) == "Stratify Labs, Inc");
+		TEST_ASSERT(string_list.at(2) == "StratifyOS");
+		TEST_ASSERT(string_list.at(3) == "0123456789");
+		TEST_ASSERT(string_list.at(4) == "Default");
+		TEST_ASSERT(string_list.at(5) == "StratifyOS Link");
+
+		TEST_ASSERT(sysfs.find(1, 6) == nullptr);
+
+		// one directory is read without listing the tree
+		TEST_ASSERT(sysfs.clear().load("1-1.2").entry_list().count() == 1);
+		TEST_ASSERT(sysfs.find(1, 5)->string_list().at(5) == "StratifyOS Link");
+		TEST_ASSERT(sysfs.clear().load("1-1.3").entry_list().count() == 0);
+		TEST_ASSERT(usb::Sysfs("usb-sysfs-missing").load().entry_list().count()
+			== 0);
+
+		remove_sysfs_tree(root);
+		return true;
 	}
 
 private:
+	// a failed run can leave the tree behind
+	void remove_sysfs_tree(const var::StringView root) {
+		if (fs::FileSystem().exists(root)) {
+			fs::FileSystem().remove_directory(
+				root,
+				fs::FileSystem::IsRecursive::yes);
+		}
+	}
+
+	void write_attribute(
+		const var::StringView path,
+		const var::StringView name,
+		const var::StringView value) {
+		fs::File(
+			fs::File::IsOverwrite::yes,
+			var::PathString(path).append("/").append(name))
+			.write(var::View(value));
+	}
 };